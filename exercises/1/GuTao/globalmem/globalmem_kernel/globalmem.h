@@ -0,0 +1,77 @@
+#ifndef _GLOBALMEM_H_
+#define _GLOBALMEM_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define GLOBALMEM_MAGIC 'g'
+
+struct globalmem_range
+{
+    __u64 offset;
+    __u64 length;
+};
+
+/* The range ioctls below work on the stored bytes, i.e. after the write() xor. */
+
+/* repeat pattern[0..pattern_len) over the range, pattern_len is 1..8 */
+struct globalmem_fill
+{
+    __u64 offset;
+    __u64 length;
+    __u8 pattern[8];
+    __u32 pattern_len;
+    __u32 reserved;
+};
+
+struct globalmem_xor
+{
+    __u64 offset;
+    __u64 length;
+    __u8 key;
+    __u8 reserved[7];
+};
+
+/* memmove() semantics, the ranges may overlap */
+struct globalmem_copy
+{
+    __u64 src;
+    __u64 dst;
+    __u64 length;
+};
+
+/* mismatch is set to the index of the first differing byte, or -1 */
+struct globalmem_compare
+{
+    __u64 offset;
+    __u64 length;
+    __u64 buf;		/* user pointer */
+    __s64 mismatch;
+};
+
+/*
+ * Sleep until something in [offset, offset + length) is stored to after
+ * generation gen. Pass 0 the first time, then the gen handed back; it is
+ * read before the caller looks at the data, so no store goes unnoticed.
+ * Generations are tracked per stripe of pages, a wakeup can be spurious
+ * but never missed. Stores through mmap() are not seen until COMMIT.
+ */
+struct globalmem_wait
+{
+    __u64 offset;
+    __u64 length;
+    __u64 gen;		/* in: last generation seen, out: current one */
+    __s32 timeout_ms;	/* < 0 waits forever, 0 just checks */
+    __u32 changed;	/* out: 0 on timeout */
+};
+
+#define GLOBALMEM_CLEAR     _IO(GLOBALMEM_MAGIC, 0)
+/* xor [offset, offset + length) with 0x55, for data stored through mmap() */
+#define GLOBALMEM_COMMIT    _IOW(GLOBALMEM_MAGIC, 1, struct globalmem_range)
+#define GLOBALMEM_FILL      _IOW(GLOBALMEM_MAGIC, 2, struct globalmem_fill)
+#define GLOBALMEM_XOR       _IOW(GLOBALMEM_MAGIC, 3, struct globalmem_xor)
+#define GLOBALMEM_COPY      _IOW(GLOBALMEM_MAGIC, 4, struct globalmem_copy)
+#define GLOBALMEM_COMPARE   _IOWR(GLOBALMEM_MAGIC, 5, struct globalmem_compare)
+#define GLOBALMEM_WAIT      _IOWR(GLOBALMEM_MAGIC, 6, struct globalmem_wait)
+
+#endif
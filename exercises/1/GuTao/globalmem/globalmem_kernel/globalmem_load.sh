@@ -7,7 +7,15 @@ mode="664"
 /sbin/insmod ./$module.ko $* || exit 1
 
 major=$(awk "\$2==\"$module\" {print \$1}" /proc/devices)
+nr_devs=$(cat /sys/module/$module/parameters/globalmem_nr_devs)
 
-rm -f /dev/${device}
+# minor 0 keeps the old /dev/globalmem name, the others are /dev/globalmemN
+rm -f /dev/${device} /dev/${device}[0-9]*
 mknod /dev/${device} c $major 0
-chmod $mode  /dev/${device}
\ No newline at end of file
+chmod $mode  /dev/${device}
+i=1
+while [ $i -lt $nr_devs ]; do
+    mknod /dev/${device}$i c $major $i
+    chmod $mode  /dev/${device}$i
+    i=$((i + 1))
+done
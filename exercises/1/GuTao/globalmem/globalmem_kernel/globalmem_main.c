@@ -11,154 +11,879 @@
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 #include <linux/uaccess.h>	/* copy_*_user */
+#include <linux/uio.h>		/* iov_iter */
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>	/* lock_page() */
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>	/* signal_pending() */
+#include "globalmem.h"
+#include "zfxor.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("gutao");
 MODULE_DESCRIPTION("simple cdev linux driver called globalmem");
 
-#define GLOBALMEM_SIZE 1024
+#define GLOBALMEM_SIZE (1024 * 1024)	/* default size, whole pages so it can be mmap()ed */
+/*
+ * pages are only allocated when written, so the size just bounds offsets;
+ * offsets are loff_t, so it has to fit one as well
+ */
+#define GLOBALMEM_MAX_SIZE ((unsigned long)min_t(u64, MAX_LFS_FILESIZE, ULONG_MAX) & PAGE_MASK)
+#define GLOBALMEM_MAX_DEVS 32
 #define GLOBALMEM_MAJOR 200
-#define GLOBALMEM_MAGIC 'g'
-#define GLOBALMEM_CLEAR _IO(GLOBALMEM_MAGIC, 0)
+#define GLOBALMEM_CHUNK PAGE_SIZE	/* longest store a reader can spin on */
+#define GLOBALMEM_STRIPES 64	/* power of two */
+#define GLOBALMEM_DIRTY XA_MARK_0	/* page not yet in the image file */
+
+/*
+ * Chunk i of the buffer is guarded by stripes[i % GLOBALMEM_STRIPES], so
+ * writers to disjoint pages mostly take different locks.
+ */
+struct globalmem_stripe
+{
+    struct mutex mutex;	/* serializes writers */
+    seqcount_mutex_t seq;	/* lets readers copy without the mutex */
+    atomic64_t mod_gen;		/* devp->mod_gen of the last store here */
+} ____cacheline_aligned_in_smp;
 
 struct globalmem_dev
 {
     struct cdev cdev;
-    unsigned char mem[GLOBALMEM_SIZE];
-    struct mutex mutex;
+    struct xarray pages;	/* page index -> struct page, holes read as zeros */
+    size_t size;
+    /*
+     * Bumped by GLOBALMEM_CLEAR. A page stamped (page_private) with an
+     * older generation reads as zeros and is zeroed on its next store.
+     */
+    atomic_long_t gen;
+    struct work_struct reclaim_work;	/* frees pages left stale by a clear */
+    struct file *image;			/* backing file, NULL without globalmem_image */
+    unsigned long image_gen;		/* generation the image file holds */
+    struct delayed_work checkpoint_work;
+    atomic64_t mod_gen;			/* bumped once per store operation, see GLOBALMEM_WAIT */
+    wait_queue_head_t range_wait;	/* GLOBALMEM_WAIT sleepers, keyed by range */
+    wait_queue_head_t poll_wait;
+    struct globalmem_stripe stripes[GLOBALMEM_STRIPES];
+};
+
+/* one per open(), so poll() can tell what this file has not read yet */
+struct globalmem_file
+{
+    struct globalmem_dev *devp;
+    atomic64_t seen;	/* devp->mod_gen at the last read() */
+};
+
+/* a GLOBALMEM_WAIT sleeper, only woken by stores that touch [start, end) */
+struct globalmem_waiter
+{
+    wait_queue_entry_t wait;
+    size_t start;
+    size_t end;
+};
+
+/* the key passed to range_wait wakeups */
+struct globalmem_span
+{
+    size_t start;
+    size_t end;
 };
 
 static int globalmem_major = GLOBALMEM_MAJOR;
 module_param(globalmem_major, int, S_IRUGO);
 
+/* one minor per instance, so independent users don't share stripes */
+static int globalmem_nr_devs = 1;
+module_param(globalmem_nr_devs, int, S_IRUGO);
+
+/* per-minor capacity in bytes, minors past the list use GLOBALMEM_SIZE */
+static unsigned long globalmem_sizes[GLOBALMEM_MAX_DEVS];
+static int globalmem_nr_sizes;
+module_param_array(globalmem_sizes, ulong, &globalmem_nr_sizes, S_IRUGO);
+
+/*
+ * Optional image: minor N restores from "<globalmem_image>.N" at load and
+ * writes its dirty pages back every globalmem_checkpoint_ms and at unload.
+ */
+static char *globalmem_image;
+module_param(globalmem_image, charp, S_IRUGO);
+
+/* each checkpoint writes every dirty page and fsyncs, so don't let it spin */
+#define GLOBALMEM_MIN_CHECKPOINT_MS 10
+static unsigned int globalmem_checkpoint_ms = 1000;
+module_param(globalmem_checkpoint_ms, uint, S_IRUGO);
+
 static struct globalmem_dev *globalmem_devp;
 
+static struct globalmem_dev *globalmem_filp_dev(struct file *filp)
+{
+    struct globalmem_file *gf = filp->private_data;
+
+    return gf ? gf->devp : NULL;
+}
+
+static struct globalmem_stripe *globalmem_stripe(struct globalmem_dev *devp, size_t p)
+{
+    return &devp->stripes[(p / GLOBALMEM_CHUNK) & (GLOBALMEM_STRIPES - 1)];
+}
+
+/* length of [p, p + count) that stays inside one GLOBALMEM_CHUNK */
+static size_t globalmem_chunk(size_t p, size_t count)
+{
+    return min_t(size_t, count, GLOBALMEM_CHUNK - (p & (GLOBALMEM_CHUNK - 1)));
+}
+
+static bool globalmem_range_ok(struct globalmem_dev *devp, __u64 offset, __u64 length)
+{
+    return offset <= devp->size && length <= devp->size - offset;
+}
+
+static bool globalmem_page_live(struct globalmem_dev *devp, struct page *page)
+{
+    return page_private(page) == (unsigned long)atomic_long_read(&devp->gen);
+}
+
+/*
+ * bytes at p for a lockless reader, the zero page for a hole or a page
+ * from before the last clear; caller holds rcu_read_lock()
+ */
+static const unsigned char *globalmem_peek(struct globalmem_dev *devp, size_t p)
+{
+    struct page *page = xa_load(&devp->pages, p >> PAGE_SHIFT);
+
+    if (page == NULL || !globalmem_page_live(devp, page))
+    {
+        return (const unsigned char *)page_address(ZERO_PAGE(0)) + offset_in_page(p);
+    }
+    return (const unsigned char *)page_address(page) + offset_in_page(p);
+}
+
+/*
+ * page holding p, allocated zeroed on first use and zeroed again if a clear
+ * happened since it was last stored to; caller holds its stripe mutex
+ */
+static struct page *globalmem_get_page(struct globalmem_dev *devp, size_t p, gfp_t gfp)
+{
+    struct globalmem_stripe *stripe = globalmem_stripe(devp, p);
+    unsigned long index = p >> PAGE_SHIFT;
+    struct page *page = xa_load(&devp->pages, index);
+
+    if (page)
+    {
+        if (!globalmem_page_live(devp, page))
+        {
+            write_seqcount_begin(&stripe->seq);
+            memset(page_address(page), 0, PAGE_SIZE);
+            set_page_private(page, atomic_long_read(&devp->gen));
+            write_seqcount_end(&stripe->seq);
+        }
+        return page;
+    }
+
+    page = alloc_page(gfp | __GFP_ZERO);
+    if (page == NULL)
+    {
+        return NULL;
+    }
+    set_page_private(page, atomic_long_read(&devp->gen));
+    if (xa_is_err(xa_store(&devp->pages, index, page, gfp)))
+    {
+        __free_page(page);
+        return NULL;
+    }
+    return page;
+}
+
+/* stamps race once the stripe mutex is dropped, so never move mod_gen backwards */
+static void globalmem_stamp(struct globalmem_stripe *stripe, s64 mod_gen)
+{
+    s64 old = atomic64_read(&stripe->mod_gen);
+
+    while (old < mod_gen && !atomic64_try_cmpxchg(&stripe->mod_gen, &old, mod_gen))
+        ;
+}
+
+/*
+ * Changes one chunk in place. done is how far into the whole operation the
+ * chunk starts, arg is whatever the caller passed along.
+ */
+typedef void (*globalmem_update_fn)(unsigned char *dst, size_t count, size_t done,
+                                    const void *arg);
+
+/* write(): arg is the bounce holding this chunk of user data */
+static void globalmem_encode_fn(unsigned char *dst, size_t count, size_t done, const void *arg)
+{
+    zf_xor(dst, arg, count, ZF_XOR_KEY);
+}
+
+/* arg points at the key */
+static void globalmem_xor_fn(unsigned char *dst, size_t count, size_t done, const void *arg)
+{
+    zf_xor(dst, dst, count, *(const unsigned char *)arg);
+}
+
+/* arg is the bounce holding this chunk of source data */
+static void globalmem_copy_fn(unsigned char *dst, size_t count, size_t done, const void *arg)
+{
+    memcpy(dst, arg, count);
+}
+
+struct globalmem_pattern
+{
+    const unsigned char *buf;	/* pattern repeated over GLOBALMEM_CHUNK + len bytes */
+    size_t len;
+};
+
+static void globalmem_fill_fn(unsigned char *dst, size_t count, size_t done, const void *arg)
+{
+    const struct globalmem_pattern *pattern = arg;
+
+    memcpy(dst, pattern->buf + done % pattern->len, count);
+}
+
+/*
+ * Run fn on one chunk. Readers never take the mutex, they retry on stripe->seq,
+ * so fn must not sleep and the write section stays within GLOBALMEM_CHUNK.
+ * A hole gets its page here. nowait gives up with -EAGAIN instead of sleeping
+ * on a busy stripe or in the page allocator.
+ */
+static int globalmem_update_chunk(struct globalmem_dev *devp, size_t p, size_t count, size_t done,
+                                  globalmem_update_fn fn, const void *arg, bool nowait)
+{
+    struct globalmem_stripe *stripe = globalmem_stripe(devp, p);
+    struct page *page = NULL;
+
+    if (nowait)
+    {
+        if (!mutex_trylock(&stripe->mutex))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        mutex_lock(&stripe->mutex);
+    }
+
+    page = globalmem_get_page(devp, p, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (page == NULL)
+    {
+        mutex_unlock(&stripe->mutex);
+        return nowait ? -EAGAIN : -ENOMEM;
+    }
+
+    write_seqcount_begin(&stripe->seq);
+    fn((unsigned char *)page_address(page) + offset_in_page(p), count, done, arg);
+    write_seqcount_end(&stripe->seq);
+    if (devp->image)
+    {
+        xa_set_mark(&devp->pages, p >> PAGE_SHIFT, GLOBALMEM_DIRTY);
+    }
+    mutex_unlock(&stripe->mutex);
+    return 0;
+}
+
+static int globalmem_range_wake(wait_queue_entry_t *wait, unsigned int mode, int sync, void *key)
+{
+    struct globalmem_waiter *waiter = container_of(wait, struct globalmem_waiter, wait);
+    const struct globalmem_span *span = key;
+
+    if (span->end <= waiter->start || span->start >= waiter->end)
+    {
+        return 0;
+    }
+    return autoremove_wake_function(wait, mode, sync, key);
+}
+
+/*
+ * Stamp the stripes under [p, p + count) and wake whoever waits on them, once
+ * per operation rather than per chunk, so writers to disjoint pages only meet
+ * on devp->mod_gen here. Without sleepers the wakeups are two barriers and no
+ * lock.
+ */
+static void globalmem_notify(struct globalmem_dev *devp, size_t p, size_t count)
+{
+    struct globalmem_span span = { p, p + count };
+    size_t first = p / GLOBALMEM_CHUNK;
+    size_t last = 0;
+    size_t i = 0;
+    s64 mod_gen = 0;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    /* after the data, so a waiter that sampled mod_gen first can't miss it */
+    mod_gen = atomic64_inc_return(&devp->mod_gen);
+    last = (p + count - 1) / GLOBALMEM_CHUNK;
+    if (last - first >= GLOBALMEM_STRIPES)
+    {
+        last = first + GLOBALMEM_STRIPES - 1;
+    }
+    for (i = first; i <= last; ++i)
+    {
+        globalmem_stamp(&devp->stripes[i & (GLOBALMEM_STRIPES - 1)], mod_gen);
+    }
+    if (wq_has_sleeper(&devp->range_wait))
+    {
+        __wake_up(&devp->range_wait, TASK_INTERRUPTIBLE, 0, &span);
+    }
+    if (wq_has_sleeper(&devp->poll_wait))
+    {
+        wake_up_interruptible_poll(&devp->poll_wait, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+/* only one stripe is held at a time, so a range never blocks the whole device */
+static int globalmem_update_range(struct globalmem_dev *devp, size_t p, size_t count,
+                                  globalmem_update_fn fn, const void *arg)
+{
+    size_t done = 0;
+    size_t n = 0;
+    int ret = 0;
+
+    for (done = 0; done < count; done += n)
+    {
+        n = globalmem_chunk(p + done, count - done);
+        ret = globalmem_update_chunk(devp, p + done, n, done, fn, arg, false);
+        if (ret)
+        {
+            break;
+        }
+        cond_resched();
+    }
+    globalmem_notify(devp, p, done);
+    return ret;
+}
+
+/* copy [p, p + count) out under the stripe seqcounts, without any mutex */
+static void globalmem_load(struct globalmem_dev *devp, size_t p, unsigned char *dst, size_t count)
+{
+    struct globalmem_stripe *stripe = NULL;
+    unsigned int seq = 0;
+    size_t done = 0;
+    size_t n = 0;
+
+    for (done = 0; done < count; done += n)
+    {
+        n = globalmem_chunk(p + done, count - done);
+        stripe = globalmem_stripe(devp, p + done);
+        rcu_read_lock();
+        do
+        {
+            seq = read_seqcount_begin(&stripe->seq);
+            memcpy(dst + done, globalmem_peek(devp, p + done), n);
+        } while (read_seqcount_retry(&stripe->seq, seq));
+        rcu_read_unlock();
+    }
+}
+
+/* constant time: stale pages read as zeros until reclaimed or stored to */
+static void globalmem_clear(struct globalmem_dev *devp)
+{
+    atomic_long_inc(&devp->gen);
+    schedule_work(&devp->reclaim_work);
+
+    /* every byte changed, as far as waiters are concerned */
+    globalmem_notify(devp, 0, devp->size);
+}
+
+/*
+ * Give stale pages back in the background. A page that is mapped, or locked
+ * by a fault that is about to map it, is zeroed in place instead; mappings
+ * keep showing the old bytes until this gets to their page.
+ */
+static void globalmem_reclaim(struct work_struct *work)
+{
+    struct globalmem_dev *devp = container_of(work, struct globalmem_dev, reclaim_work);
+    struct globalmem_stripe *stripe = NULL;
+    struct page *page = NULL;
+    struct page *next = NULL;
+    unsigned long index = 0;
+    bool freed = false;
+    LIST_HEAD(free_list);
+
+    xa_for_each(&devp->pages, index, page)
+    {
+        stripe = globalmem_stripe(devp, index << PAGE_SHIFT);
+        mutex_lock(&stripe->mutex);
+        if (globalmem_page_live(devp, page))
+        {
+            mutex_unlock(&stripe->mutex);
+            continue;
+        }
+
+        write_seqcount_begin(&stripe->seq);
+        freed = false;
+        if (trylock_page(page))
+        {
+            if (!page_mapped(page))
+            {
+                xa_erase(&devp->pages, index);
+                list_add(&page->lru, &free_list);
+                freed = true;
+            }
+            unlock_page(page);
+        }
+        if (!freed)
+        {
+            memset(page_address(page), 0, PAGE_SIZE);
+            set_page_private(page, atomic_long_read(&devp->gen));
+        }
+        write_seqcount_end(&stripe->seq);
+        mutex_unlock(&stripe->mutex);
+        cond_resched();
+    }
+
+    /* lockless readers may still be copying out of the erased pages */
+    synchronize_rcu();
+    list_for_each_entry_safe(page, next, &free_list, lru)
+    {
+        list_del(&page->lru);
+        set_page_private(page, 0);
+        __free_page(page);
+    }
+}
+
+static int globalmem_fill_range(struct globalmem_dev *devp, const struct globalmem_fill *fill)
+{
+    struct globalmem_pattern pattern;
+    unsigned char *buf = NULL;
+    size_t i = 0;
+    int ret = 0;
+
+    if (fill->pattern_len < 1 || fill->pattern_len > sizeof(fill->pattern))
+    {
+        return -EINVAL;
+    }
+
+    buf = kmalloc(GLOBALMEM_CHUNK + fill->pattern_len, GFP_KERNEL);
+    if (buf == NULL)
+    {
+        return -ENOMEM;
+    }
+    for (i = 0; i < GLOBALMEM_CHUNK + fill->pattern_len; ++i)
+    {
+        buf[i] = fill->pattern[i % fill->pattern_len];
+    }
+
+    pattern.buf = buf;
+    pattern.len = fill->pattern_len;
+    ret = globalmem_update_range(devp, fill->offset, fill->length, globalmem_fill_fn, &pattern);
+    kfree(buf);
+    return ret;
+}
+
+/* memmove() semantics, one destination chunk locked at a time */
+static int globalmem_copy_range(struct globalmem_dev *devp, size_t src, size_t dst, size_t count)
+{
+    /* overlapping with dst above src: walk backwards so source bytes are read first */
+    bool backward = dst > src && dst < src + count;
+    unsigned char *bounce = NULL;
+    size_t done = 0;
+    size_t off = 0;
+    size_t n = 0;
+    int ret = 0;
+
+    bounce = kmalloc(min_t(size_t, count, GLOBALMEM_CHUNK), GFP_KERNEL);
+    if (bounce == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for (done = 0; done < count; done += n)
+    {
+        if (backward)
+        {
+            n = min_t(size_t, count - done, ((dst + count - done - 1) & (GLOBALMEM_CHUNK - 1)) + 1);
+            off = count - done - n;
+        }
+        else
+        {
+            n = globalmem_chunk(dst + done, count - done);
+            off = done;
+        }
+        globalmem_load(devp, src + off, bounce, n);
+        ret = globalmem_update_chunk(devp, dst + off, n, off, globalmem_copy_fn, bounce, false);
+        if (ret)
+        {
+            break;
+        }
+        cond_resched();
+    }
+    /* a failed copy may have stored a piece anywhere in dst */
+    globalmem_notify(devp, dst, ret ? count : done);
+
+    kfree(bounce);
+    return ret;
+}
+
+/* index of the first byte that differs, count if none does */
+static size_t globalmem_mismatch(const unsigned char *a, const unsigned char *b, size_t count)
+{
+    size_t i = 0;
+
+    if (memcmp(a, b, count) == 0)
+    {
+        return count;
+    }
+    /* a may be live page data, a store can undo the difference; the seqcount retry drops it */
+    while (i < count && a[i] == b[i])
+    {
+        ++i;
+    }
+    return i;
+}
+
+static int globalmem_compare_range(struct globalmem_dev *devp, struct globalmem_compare *cmp)
+{
+    const unsigned char __user *ubuf = u64_to_user_ptr(cmp->buf);
+    struct globalmem_stripe *stripe = NULL;
+    unsigned char *bounce = NULL;
+    unsigned int seq = 0;
+    size_t p = cmp->offset;
+    size_t done = 0;
+    size_t diff = 0;
+    size_t n = 0;
+    int ret = 0;
+
+    bounce = kmalloc(min_t(size_t, cmp->length, GLOBALMEM_CHUNK), GFP_KERNEL);
+    if (bounce == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    cmp->mismatch = -1;
+    for (done = 0; done < cmp->length; done += n)
+    {
+        n = globalmem_chunk(p + done, cmp->length - done);
+        if (copy_from_user(bounce, ubuf + done, n))
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        stripe = globalmem_stripe(devp, p + done);
+        rcu_read_lock();
+        do
+        {
+            seq = read_seqcount_begin(&stripe->seq);
+            diff = globalmem_mismatch(globalmem_peek(devp, p + done), bounce, n);
+        } while (read_seqcount_retry(&stripe->seq, seq));
+        rcu_read_unlock();
+
+        if (diff < n)
+        {
+            cmp->mismatch = done + diff;
+            break;
+        }
+        cond_resched();
+    }
+
+    kfree(bounce);
+    return ret;
+}
+
+/* has a stripe under [p, p + count) been stored to after gen */
+static bool globalmem_changed(struct globalmem_dev *devp, size_t p, size_t count, u64 gen)
+{
+    size_t first = p / GLOBALMEM_CHUNK;
+    size_t last = (p + count - 1) / GLOBALMEM_CHUNK;
+    size_t i = 0;
+
+    if (last - first >= GLOBALMEM_STRIPES)
+    {
+        last = first + GLOBALMEM_STRIPES - 1;
+    }
+    for (i = first; i <= last; ++i)
+    {
+        if ((u64)atomic64_read(&devp->stripes[i & (GLOBALMEM_STRIPES - 1)].mod_gen) > gen)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int globalmem_wait_range(struct globalmem_dev *devp, struct globalmem_wait *w)
+{
+    long timeout = w->timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(w->timeout_ms);
+    struct globalmem_waiter waiter;
+    int ret = 0;
+
+    init_waitqueue_func_entry(&waiter.wait, globalmem_range_wake);
+    /* prepare_to_wait() only queues an entry that is list_empty() */
+    INIT_LIST_HEAD(&waiter.wait.entry);
+    waiter.wait.private = current;
+    waiter.start = w->offset;
+    waiter.end = w->offset + w->length;
+
+    w->changed = 0;
+    for (;;)
+    {
+        /* queued before the check, so a store right after it still wakes us */
+        prepare_to_wait(&devp->range_wait, &waiter.wait, TASK_INTERRUPTIBLE);
+        if (globalmem_changed(devp, w->offset, w->length, w->gen))
+        {
+            w->changed = 1;
+            break;
+        }
+        if (timeout == 0)
+        {
+            break;
+        }
+        if (signal_pending(current))
+        {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        timeout = schedule_timeout(timeout);
+    }
+    finish_wait(&devp->range_wait, &waiter.wait);
+
+    w->gen = atomic64_read(&devp->mod_gen);
+    return ret;
+}
+
 static int globalmem_open(struct inode *inode, struct file *filp)
 {
-	filp->private_data = globalmem_devp;
+	struct globalmem_file *gf = kmalloc(sizeof(*gf), GFP_KERNEL);
+
+	if (gf == NULL)
+		return -ENOMEM;
+	gf->devp = container_of(inode->i_cdev, struct globalmem_dev, cdev);
+	atomic64_set(&gf->seen, 0);
+	filp->private_data = gf;
+	/* io_uring/aio may call read_iter/write_iter with IOCB_NOWAIT */
+	filp->f_mode |= FMODE_NOWAIT;
 	return 0;
 }
 
 static int globalmem_release(struct inode *inode, struct file *filp)
 {
+	kfree(filp->private_data);
 	return 0;
 }
 
-static ssize_t globalmem_read(struct file *filp, char __user *buf, size_t count,
-                              loff_t *f_pos)
+static ssize_t globalmem_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    loff_t p = *f_pos;
-    struct globalmem_dev *devp = (struct globalmem_dev *)(filp->private_data);
-    int ret = 0;
+    loff_t p = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    struct globalmem_file *gf = iocb->ki_filp->private_data;
+    struct globalmem_dev *devp = globalmem_filp_dev(iocb->ki_filp);
+    unsigned char *bounce = NULL;
+    size_t done = 0;
+    size_t n = 0;
+    ssize_t ret = 0;
 
     if (devp == NULL)
     {
         return -EINVAL;
     }
+    /* before copying, so poll() reports any store we might have missed */
+    atomic64_set(&gf->seen, atomic64_read(&devp->mod_gen));
 
-    if (p >= GLOBALMEM_SIZE) 
+    if (p >= devp->size) 
         return 0;
-    if (count > GLOBALMEM_SIZE - p) 
-        count = GLOBALMEM_SIZE - p;
-    
-    mutex_lock(&devp->mutex);
-    if (copy_to_user(buf, devp->mem + p, count))
+    if (count > devp->size - p) 
+        count = devp->size - p;
+
+    bounce = kmalloc(min_t(size_t, count, GLOBALMEM_CHUNK),
+                     (iocb->ki_flags & IOCB_NOWAIT) ? GFP_NOWAIT : GFP_KERNEL);
+    if (bounce == NULL)
     {
-        ret = -EFAULT;
+        return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
     }
-    else
+
+    while (done < count)
     {
-        *f_pos += count;
-        ret = count;
+        n = globalmem_chunk(p + done, count - done);
+        globalmem_load(devp, p + done, bounce, n);
+        if (copy_to_iter(bounce, n, to) != n)
+        {
+            ret = -EFAULT;
+            break;
+        }
+        done += n;
+    }
+    kfree(bounce);
+
+    if (done)
+    {
+        iocb->ki_pos += done;
+        ret = done;
     }
-    mutex_unlock(&devp->mutex);
 
-    return count;
+    return ret;
 }
 
-static ssize_t globalmem_write(struct file *filp, const char __user *buf, size_t count,
-                               loff_t *f_pos)
+/* one call covers every segment of a writev(), a page of bounce at a time */
+static ssize_t globalmem_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    loff_t p = *f_pos;
-    unsigned long i = 0;
-    int ret = 0;
-    struct globalmem_dev *devp = filp->private_data;
+    loff_t p = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    struct globalmem_dev *devp = globalmem_filp_dev(iocb->ki_filp);
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    unsigned char *bounce = NULL;
+    size_t done = 0;
+    size_t n = 0;
+    ssize_t ret = 0;
 
     if (devp == NULL)
     {
         return -EINVAL;
     }
 
-    if (p >= GLOBALMEM_SIZE)
+    if (count == 0)
         return 0;
-    if (count > GLOBALMEM_SIZE - p) 
-        count = GLOBALMEM_SIZE - p;
-    
-    mutex_lock(&devp->mutex);
-    if (copy_from_user((void*)(devp->mem + p), buf, count))
+    if (p >= devp->size)
+        return -ENOSPC;
+    if (count > devp->size - p) 
+        count = devp->size - p;
+
+    bounce = kmalloc(min_t(size_t, count, GLOBALMEM_CHUNK), nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (bounce == NULL)
     {
-        ret = -EFAULT;
+        return nowait ? -EAGAIN : -ENOMEM;
     }
-    else
+
+    while (done < count)
     {
-        for(i=p; i<count; ++i)
+        n = globalmem_chunk(p + done, count - done);
+        /* may fault, so it stays outside the write section */
+        if (copy_from_iter(bounce, n, from) != n)
+        {
+            ret = -EFAULT;
+            break;
+        }
+        ret = globalmem_update_chunk(devp, p + done, n, done, globalmem_encode_fn, bounce, nowait);
+        if (ret)
         {
-            devp->mem[i] = devp->mem[i] ^ 0x55;
+            iov_iter_revert(from, n);
+            break;
         }
-        *f_pos += count;
-        ret = count;
+        done += n;
     }
-    mutex_unlock(&devp->mutex);
+    kfree(bounce);
+    globalmem_notify(devp, p, done);
 
-    return count;
+    if (done)
+    {
+        iocb->ki_pos += done;
+        ret = done;
+    }
+
+    return ret;
+}
+
+/* POLLIN once something was stored since this file last read(), POLLOUT always */
+static __poll_t globalmem_poll(struct file *filp, poll_table *wait)
+{
+    struct globalmem_file *gf = filp->private_data;
+    struct globalmem_dev *devp = gf->devp;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &devp->poll_wait, wait);
+    if (atomic64_read(&devp->mod_gen) > atomic64_read(&gf->seen))
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
 }
 
+/* SEEK_DATA/SEEK_HOLE work in whole pages, the end of the device counts as a hole */
+static loff_t globalmem_seek_data(struct globalmem_dev *devp, loff_t offset, bool hole)
+{
+    unsigned long index = offset >> PAGE_SHIFT;
+    unsigned long last = (devp->size - 1) >> PAGE_SHIFT;
+    struct page *page = NULL;
+
+    if (offset < 0 || offset >= devp->size)
+    {
+        return -ENXIO;
+    }
+
+    if (!hole)
+    {
+        xa_for_each_range(&devp->pages, index, page, offset >> PAGE_SHIFT, last)
+        {
+            if (globalmem_page_live(devp, page))
+            {
+                return max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT);
+            }
+        }
+        return -ENXIO;
+    }
+
+    while (index <= last && (page = xa_load(&devp->pages, index)) &&
+           globalmem_page_live(devp, page))
+    {
+        ++index;
+    }
+    if (index > last)
+    {
+        return devp->size;
+    }
+    return max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT);
+}
+
+/* read_iter/write_iter only use iocb->ki_pos, so pread/pwrite need nothing more */
 loff_t globalmem_llseek(struct file *filp, loff_t offset, int whence)
 {
 	loff_t ret = 0;
+    struct globalmem_dev *devp = globalmem_filp_dev(filp);
 
 	switch (whence)
     {
-        case 0: //SEEK_SET
-            if (offset < 0)
-            {
-                ret = -EINVAL;
-                break;
-            }
-            if ((unsigned int)offset > GLOBALMEM_SIZE)
-            {
-                ret = -EINVAL;
-                break;
-            }
-            filp->f_pos = (unsigned int)offset;
-            ret = filp->f_pos;
+        case SEEK_SET:
+            ret = offset;
             break;
-        case 1: //SEEK_CUR
-            if ((filp->f_pos + offset) > GLOBALMEM_SIZE)
-            {
-                ret = -EINVAL;
-                break;
-            }
-            if ((filp->f_pos + offset) < 0)
+        case SEEK_CUR:
+            ret = filp->f_pos + offset;
+            break;
+        case SEEK_END:
+            ret = devp->size + offset;
+            break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            ret = globalmem_seek_data(devp, offset, whence == SEEK_HOLE);
+            if (ret < 0)
             {
-                ret = -EINVAL;
-                break;
+                return ret;
             }
-            filp->f_pos += (unsigned int)offset;
-            ret = filp->f_pos;
             break;
         default:
-            ret = -EINVAL;
-            break;
+            return -EINVAL;
     }
+
+    if (ret < 0 || ret > devp->size)
+    {
+        return -EINVAL;
+    }
+    filp->f_pos = ret;
 	
 	return ret;
 }
 
 static long globalmem_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
 {
-    struct globalmem_dev *devp = filp->private_data;
+    struct globalmem_dev *devp = globalmem_filp_dev(filp);
+    void __user *argp = (void __user *)arg;
+    unsigned char key = ZF_XOR_KEY;
+    struct globalmem_range range;
+    struct globalmem_fill fill;
+    struct globalmem_xor xkey;
+    struct globalmem_copy copy;
+    struct globalmem_compare cmp;
+    struct globalmem_wait wait;
+    int ret = 0;
+
     if (devp == NULL)
     {
         return -EINVAL;
@@ -167,14 +892,157 @@ static long globalmem_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
     switch (cmd)
     {
     case GLOBALMEM_CLEAR:
-        mutex_lock(&devp->mutex);
-        memset(devp->mem, 0, GLOBALMEM_SIZE);
-        mutex_unlock(&devp->mutex);
+        globalmem_clear(devp);
+        break;
+    case GLOBALMEM_COMMIT:
+        if (copy_from_user(&range, argp, sizeof(range)))
+        {
+            return -EFAULT;
+        }
+        if (!globalmem_range_ok(devp, range.offset, range.length))
+        {
+            return -EINVAL;
+        }
+        ret = globalmem_update_range(devp, range.offset, range.length, globalmem_xor_fn, &key);
+        break;
+    case GLOBALMEM_FILL:
+        if (copy_from_user(&fill, argp, sizeof(fill)))
+        {
+            return -EFAULT;
+        }
+        if (!globalmem_range_ok(devp, fill.offset, fill.length))
+        {
+            return -EINVAL;
+        }
+        ret = globalmem_fill_range(devp, &fill);
+        break;
+    case GLOBALMEM_XOR:
+        if (copy_from_user(&xkey, argp, sizeof(xkey)))
+        {
+            return -EFAULT;
+        }
+        if (!globalmem_range_ok(devp, xkey.offset, xkey.length))
+        {
+            return -EINVAL;
+        }
+        ret = globalmem_update_range(devp, xkey.offset, xkey.length, globalmem_xor_fn, &xkey.key);
+        break;
+    case GLOBALMEM_COPY:
+        if (copy_from_user(&copy, argp, sizeof(copy)))
+        {
+            return -EFAULT;
+        }
+        if (!globalmem_range_ok(devp, copy.src, copy.length) ||
+            !globalmem_range_ok(devp, copy.dst, copy.length))
+        {
+            return -EINVAL;
+        }
+        ret = globalmem_copy_range(devp, copy.src, copy.dst, copy.length);
+        break;
+    case GLOBALMEM_COMPARE:
+        if (copy_from_user(&cmp, argp, sizeof(cmp)))
+        {
+            return -EFAULT;
+        }
+        if (!globalmem_range_ok(devp, cmp.offset, cmp.length))
+        {
+            return -EINVAL;
+        }
+        ret = globalmem_compare_range(devp, &cmp);
+        if (ret == 0 && copy_to_user(argp, &cmp, sizeof(cmp)))
+        {
+            ret = -EFAULT;
+        }
+        break;
+    case GLOBALMEM_WAIT:
+        if (copy_from_user(&wait, argp, sizeof(wait)))
+        {
+            return -EFAULT;
+        }
+        if (wait.length == 0 || !globalmem_range_ok(devp, wait.offset, wait.length))
+        {
+            return -EINVAL;
+        }
+        ret = globalmem_wait_range(devp, &wait);
+        if (ret == 0 && copy_to_user(argp, &wait, sizeof(wait)))
+        {
+            ret = -EFAULT;
+        }
         break;
     default:
         return -EINVAL;
     }
     
+    return ret;
+}
+
+/*
+ * Pages are handed out on first touch, so a mapping costs nothing until it
+ * is used. The page comes back locked; globalmem_reclaim() leaves locked and
+ * mapped pages in place, which closes the race with a fault in flight.
+ */
+static vm_fault_t globalmem_vm_fault(struct vm_fault *vmf)
+{
+    struct globalmem_dev *devp = vmf->vma->vm_private_data;
+    size_t p = (size_t)vmf->pgoff << PAGE_SHIFT;
+    struct globalmem_stripe *stripe = NULL;
+    struct page *page = NULL;
+
+    if (p >= devp->size)
+    {
+        return VM_FAULT_SIGBUS;
+    }
+
+    stripe = globalmem_stripe(devp, p);
+    mutex_lock(&stripe->mutex);
+    page = globalmem_get_page(devp, p, GFP_KERNEL);
+    if (page)
+    {
+        get_page(page);
+        lock_page(page);
+        if (devp->image)
+        {
+            /* stays dirty while mapped, see globalmem_checkpoint() */
+            xa_set_mark(&devp->pages, vmf->pgoff, GLOBALMEM_DIRTY);
+        }
+    }
+    mutex_unlock(&stripe->mutex);
+
+    if (page == NULL)
+    {
+        return VM_FAULT_OOM;
+    }
+    vmf->page = page;
+    return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct globalmem_vm_ops =
+{
+    .fault = globalmem_vm_fault,
+};
+
+/*
+ * Map the pages shared by every opener. Stores through the mapping
+ * bypass the xor done by write(), GLOBALMEM_COMMIT applies it afterwards.
+ * They also bypass the stripe seqcounts, so readers may see them half done.
+ */
+static int globalmem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct globalmem_dev *devp = globalmem_filp_dev(filp);
+
+    if (devp == NULL)
+    {
+        return -EINVAL;
+    }
+    if (!globalmem_range_ok(devp, (__u64)vma->vm_pgoff << PAGE_SHIFT,
+                            vma->vm_end - vma->vm_start))
+    {
+        return -EINVAL;
+    }
+
+    vma->vm_ops = &globalmem_vm_ops;
+    vma->vm_private_data = devp;
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
     return 0;
 }
 
@@ -182,15 +1050,206 @@ static struct file_operations globalmem_fops =
 {
 	.owner =    THIS_MODULE,
 	.llseek =   globalmem_llseek,
-	.read =     globalmem_read,
-	.write =    globalmem_write,
+	.read_iter =  globalmem_read_iter,
+	.write_iter = globalmem_write_iter,
+	.mmap =     globalmem_mmap,
+	.poll =     globalmem_poll,
 	.open =     globalmem_open,
     .compat_ioctl = globalmem_ioctl,
     .unlocked_ioctl = globalmem_ioctl,
 	.release =  globalmem_release,
 };
 
-static void globalmem_setup_cdev(struct globalmem_dev *dev, int index)
+/*
+ * Write dirty pages to the image. A clear since the last pass truncates the
+ * file first; every page stored to after that clear is dirty anyway. Mapped
+ * pages can change without us noticing, so they stay dirty until unmapped.
+ */
+static int globalmem_checkpoint(struct globalmem_dev *devp)
+{
+    unsigned long gen = atomic_long_read(&devp->gen);
+    struct globalmem_stripe *stripe = NULL;
+    struct page *page = NULL;
+    unsigned char *bounce = NULL;
+    unsigned long index = 0;
+    ssize_t written = 0;
+    bool wrote = false;
+    bool live = false;
+    loff_t pos = 0;
+    int ret = 0;
+
+    bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (bounce == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    if (gen != devp->image_gen)
+    {
+        ret = vfs_truncate(&devp->image->f_path, 0);
+        if (ret)
+        {
+            goto out;
+        }
+        devp->image_gen = gen;
+        wrote = true;
+    }
+
+    xa_for_each_marked(&devp->pages, index, page, GLOBALMEM_DIRTY)
+    {
+        stripe = globalmem_stripe(devp, index << PAGE_SHIFT);
+        mutex_lock(&stripe->mutex);
+        live = page_private(page) == gen;
+        if (live)
+        {
+            memcpy(bounce, page_address(page), PAGE_SIZE);
+        }
+        /* pages stored to after a newer clear wait for the next pass */
+        if ((live || (long)(page_private(page) - gen) < 0) && !page_mapped(page))
+        {
+            xa_clear_mark(&devp->pages, index, GLOBALMEM_DIRTY);
+        }
+        mutex_unlock(&stripe->mutex);
+        if (!live)
+        {
+            continue;
+        }
+
+        pos = (loff_t)index << PAGE_SHIFT;
+        written = kernel_write(devp->image, bounce, PAGE_SIZE, &pos);
+        if (written != PAGE_SIZE)
+        {
+            xa_set_mark(&devp->pages, index, GLOBALMEM_DIRTY);
+            ret = written < 0 ? written : -EIO;
+            break;
+        }
+        wrote = true;
+        cond_resched();
+    }
+
+    if (wrote && ret == 0)
+    {
+        ret = vfs_fsync(devp->image, 1);
+    }
+
+out:
+    kfree(bounce);
+    return ret;
+}
+
+static void globalmem_checkpoint_work(struct work_struct *work)
+{
+    struct globalmem_dev *devp = container_of(to_delayed_work(work), struct globalmem_dev,
+                                              checkpoint_work);
+    int ret = globalmem_checkpoint(devp);
+
+    if (ret)
+    {
+        printk("globalmem: checkpoint of globalmem%d failed: %d\n", MINOR(devp->cdev.dev), ret);
+    }
+    schedule_delayed_work(&devp->checkpoint_work, msecs_to_jiffies(globalmem_checkpoint_ms));
+}
+
+/* pull the image's data pages straight in, holes stay holes */
+static int globalmem_restore(struct globalmem_dev *devp)
+{
+    loff_t end = min_t(loff_t, i_size_read(file_inode(devp->image)), devp->size);
+    struct page *page = NULL;
+    loff_t data = 0;
+    loff_t pos = 0;
+    loff_t read_pos = 0;
+    ssize_t n = 0;
+
+    while (pos < end)
+    {
+        data = vfs_llseek(devp->image, pos, SEEK_DATA);
+        if (data < 0 || data >= end)
+        {
+            break;
+        }
+        pos = round_down(data, PAGE_SIZE);
+
+        page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (page == NULL)
+        {
+            return -ENOMEM;
+        }
+        read_pos = pos;
+        n = kernel_read(devp->image, page_address(page), PAGE_SIZE, &read_pos);
+        if (n < 0)
+        {
+            __free_page(page);
+            return n;
+        }
+        set_page_private(page, atomic_long_read(&devp->gen));
+        if (xa_is_err(xa_store(&devp->pages, pos >> PAGE_SHIFT, page, GFP_KERNEL)))
+        {
+            __free_page(page);
+            return -ENOMEM;
+        }
+
+        pos += PAGE_SIZE;
+        cond_resched();
+    }
+    return 0;
+}
+
+static int globalmem_open_image(struct globalmem_dev *dev, int index)
+{
+    char *path = NULL;
+    int ret = 0;
+
+    path = kasprintf(GFP_KERNEL, "%s.%d", globalmem_image, index);
+    if (path == NULL)
+    {
+        return -ENOMEM;
+    }
+    dev->image = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(dev->image))
+    {
+        ret = PTR_ERR(dev->image);
+        printk("globalmem: can't open image %s: %d\n", path, ret);
+        dev->image = NULL;
+        kfree(path);
+        return ret;
+    }
+    kfree(path);
+
+    dev->image_gen = atomic_long_read(&dev->gen);
+    ret = globalmem_restore(dev);
+    if (ret)
+    {
+        filp_close(dev->image, NULL);
+        dev->image = NULL;
+        return ret;
+    }
+
+    INIT_DELAYED_WORK(&dev->checkpoint_work, globalmem_checkpoint_work);
+    schedule_delayed_work(&dev->checkpoint_work, msecs_to_jiffies(globalmem_checkpoint_ms));
+    return 0;
+}
+
+/* last checkpoint, so a reload starts where this one stopped */
+static void globalmem_close_image(struct globalmem_dev *dev)
+{
+    int ret = 0;
+
+    if (dev->image == NULL)
+    {
+        return;
+    }
+
+    cancel_delayed_work_sync(&dev->checkpoint_work);
+    ret = globalmem_checkpoint(dev);
+    if (ret)
+    {
+        printk("globalmem: final checkpoint of globalmem%d failed: %d\n", MINOR(dev->cdev.dev), ret);
+    }
+    filp_close(dev->image, NULL);
+    dev->image = NULL;
+}
+
+static int globalmem_setup_cdev(struct globalmem_dev *dev, int index)
 {
 	int err, devno = MKDEV(globalmem_major, index);
 
@@ -200,21 +1259,59 @@ static void globalmem_setup_cdev(struct globalmem_dev *dev, int index)
 	err = cdev_add(&dev->cdev, devno, 1);
 	if (err)
 		printk("Error %d adding globalmem%d", err, index);
+	return err;
+}
+
+static void globalmem_free_pages(struct globalmem_dev *dev)
+{
+    struct page *page = NULL;
+    unsigned long index = 0;
+
+    cancel_work_sync(&dev->reclaim_work);
+    xa_for_each(&dev->pages, index, page)
+    {
+        set_page_private(page, 0);
+        __free_page(page);
+    }
+    xa_destroy(&dev->pages);
+}
+
+static void globalmem_free_dev(struct globalmem_dev *dev)
+{
+    cdev_del(&dev->cdev);
+    globalmem_close_image(dev);
+    globalmem_free_pages(dev);
 }
 
 static int __init globalmem_init_module(void)
 {
     int ret = 0;
+    int i = 0;
+    int j = 0;
     dev_t devno = 0;
+    struct globalmem_dev *dev = NULL;
+
+    if (globalmem_nr_devs < 1 || globalmem_nr_devs > GLOBALMEM_MAX_DEVS)
+    {
+        printk("globalmem: globalmem_nr_devs must be 1..%d\n", GLOBALMEM_MAX_DEVS);
+        return -EINVAL;
+    }
+
+    if (globalmem_checkpoint_ms < GLOBALMEM_MIN_CHECKPOINT_MS)
+    {
+        printk("globalmem: globalmem_checkpoint_ms must be at least %d\n",
+               GLOBALMEM_MIN_CHECKPOINT_MS);
+        return -EINVAL;
+    }
 
     if (globalmem_major)
     {
         devno = MKDEV(globalmem_major, 0);
-		ret = register_chrdev_region(devno, 1, "globalmem");
+		ret = register_chrdev_region(devno, globalmem_nr_devs, "globalmem");
     }
     else
     {
-        ret = alloc_chrdev_region(&devno, 0, 1, "globalmem");
+        ret = alloc_chrdev_region(&devno, 0, globalmem_nr_devs, "globalmem");
         globalmem_major = MAJOR(devno);
     }
     if (ret < 0)
@@ -223,27 +1320,85 @@ static int __init globalmem_init_module(void)
 		return ret;
 	}
     
-    globalmem_devp = kzalloc(sizeof(struct globalmem_dev), GFP_KERNEL);
+    globalmem_devp = kcalloc(globalmem_nr_devs, sizeof(struct globalmem_dev), GFP_KERNEL);
 	if (!globalmem_devp)
     {
 		ret = -ENOMEM;
 		goto fail_malloc;
 	}
-    
-    mutex_init(&globalmem_devp->mutex);
-    globalmem_setup_cdev(globalmem_devp, 0);
+
+    for (i = 0; i < globalmem_nr_devs; ++i)
+    {
+        dev = &globalmem_devp[i];
+        dev->size = GLOBALMEM_SIZE;
+        if (i < globalmem_nr_sizes && globalmem_sizes[i])
+        {
+            if (globalmem_sizes[i] > GLOBALMEM_MAX_SIZE)
+            {
+                printk("globalmem: globalmem%d size %lu exceeds %lu\n", i, globalmem_sizes[i],
+                       GLOBALMEM_MAX_SIZE);
+                ret = -EINVAL;
+                goto fail_dev;
+            }
+            dev->size = PAGE_ALIGN(globalmem_sizes[i]);
+        }
+
+        /* sparse, pages only show up when written */
+        xa_init(&dev->pages);
+        atomic_long_set(&dev->gen, 0);
+        INIT_WORK(&dev->reclaim_work, globalmem_reclaim);
+        atomic64_set(&dev->mod_gen, 0);
+        init_waitqueue_head(&dev->range_wait);
+        init_waitqueue_head(&dev->poll_wait);
+
+        for (j = 0; j < GLOBALMEM_STRIPES; ++j)
+        {
+            mutex_init(&dev->stripes[j].mutex);
+            seqcount_mutex_init(&dev->stripes[j].seq, &dev->stripes[j].mutex);
+            atomic64_set(&dev->stripes[j].mod_gen, 0);
+        }
+
+        if (globalmem_image && *globalmem_image)
+        {
+            ret = globalmem_open_image(dev, i);
+            if (ret)
+            {
+                globalmem_free_pages(dev);
+                goto fail_dev;
+            }
+        }
+
+        ret = globalmem_setup_cdev(dev, i);
+        if (ret)
+        {
+            globalmem_close_image(dev);
+            globalmem_free_pages(dev);
+            goto fail_dev;
+        }
+    }
     return 0;
 
+fail_dev:
+    while (i-- > 0)
+    {
+        globalmem_free_dev(&globalmem_devp[i]);
+    }
+    kfree(globalmem_devp);
 fail_malloc:
-	unregister_chrdev_region(devno, 1);
+	unregister_chrdev_region(devno, globalmem_nr_devs);
 	return ret;
 }
 
 static void globalmem_cleanup_module(void)
 {
-    cdev_del(&globalmem_devp->cdev);
+    int i = 0;
+
+    for (i = 0; i < globalmem_nr_devs; ++i)
+    {
+        globalmem_free_dev(&globalmem_devp[i]);
+    }
     kfree(globalmem_devp);
-    unregister_chrdev_region(MKDEV(globalmem_major, 0), 1);
+    unregister_chrdev_region(MKDEV(globalmem_major, 0), globalmem_nr_devs);
 }
 
 module_init(globalmem_init_module);
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include "globalmem.h"
+
+/* read/write against mmap() on /dev/globalmem, every round stores and loads size bytes */
+
+#define BENCH_BYTES (256UL * 1024 * 1024)
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t size, unsigned long rounds, double secs)
+{
+    printf("%-12s %8zu bytes %8lu rounds %10.1f MiB/s\n", name, size, rounds,
+           2.0 * size * rounds / secs / (1024 * 1024));
+}
+
+int main()
+{
+    static const size_t sizes[] = { 4096, 64 * 1024, 1024 * 1024 };
+    struct globalmem_range range;
+    unsigned long i = 0;
+    unsigned long rounds = 0;
+    unsigned int s = 0;
+    unsigned char *map = NULL;
+    unsigned char *buffer = NULL;
+    double start = 0;
+    int fd = open("/dev/globalmem", O_RDWR);
+
+    if (fd < 0)
+    {
+        perror("open /dev/globalmem");
+        return 1;
+    }
+
+    buffer = malloc(sizes[2]);
+    map = mmap(NULL, sizes[2], PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buffer == NULL || map == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    memset(buffer, 0xa5, sizes[2]);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        rounds = BENCH_BYTES / sizes[s];
+
+        start = now();
+        for (i = 0; i < rounds; ++i)
+        {
+            if (pwrite(fd, buffer, sizes[s], 0) != (ssize_t)sizes[s] ||
+                pread(fd, buffer, sizes[s], 0) != (ssize_t)sizes[s])
+            {
+                perror("pread/pwrite");
+                return 1;
+            }
+        }
+        report("read/write", sizes[s], rounds, now() - start);
+
+        start = now();
+        for (i = 0; i < rounds; ++i)
+        {
+            memcpy(map, buffer, sizes[s]);
+            memcpy(buffer, map, sizes[s]);
+        }
+        report("mmap", sizes[s], rounds, now() - start);
+
+        range.offset = 0;
+        range.length = sizes[s];
+        start = now();
+        for (i = 0; i < rounds; ++i)
+        {
+            memcpy(map, buffer, sizes[s]);
+            ioctl(fd, GLOBALMEM_COMMIT, &range);
+            memcpy(buffer, map, sizes[s]);
+        }
+        report("mmap+commit", sizes[s], rounds, now() - start);
+    }
+
+    munmap(map, sizes[2]);
+    free(buffer);
+    close(fd);
+    return 0;
+}
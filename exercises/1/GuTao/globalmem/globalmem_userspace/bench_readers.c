@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * 1..N reader threads pread() /dev/globalmem while one writer pwrite()s it.
+ * Run it against the old and the new module to compare reader scaling.
+ */
+
+#define IO_SIZE 4096
+#define SPAN (1024 * 1024)
+#define SECONDS 2
+
+static atomic_int stop;
+static int fd;
+
+struct worker
+{
+    pthread_t tid;
+    unsigned long ops;
+    unsigned long seed;
+};
+
+static void *reader(void *arg)
+{
+    struct worker *w = arg;
+    char buffer[IO_SIZE];
+    off_t off = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed))
+    {
+        off = (w->seed++ * IO_SIZE) % SPAN;
+        if (pread(fd, buffer, IO_SIZE, off) != IO_SIZE)
+        {
+            perror("pread");
+            break;
+        }
+        ++w->ops;
+    }
+    return NULL;
+}
+
+static void *writer(void *arg)
+{
+    struct worker *w = arg;
+    char buffer[IO_SIZE] = { 0 };
+    off_t off = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed))
+    {
+        off = (w->seed++ * IO_SIZE) % SPAN;
+        if (pwrite(fd, buffer, IO_SIZE, off) != IO_SIZE)
+        {
+            perror("pwrite");
+            break;
+        }
+        ++w->ops;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int max_readers = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    struct worker *workers = calloc(max_readers + 1, sizeof(struct worker));
+    unsigned long reads = 0;
+    int n = 0;
+    int i = 0;
+
+    fd = open("/dev/globalmem", O_RDWR);
+    if (fd < 0 || workers == NULL)
+    {
+        perror("open /dev/globalmem");
+        return 1;
+    }
+
+    printf("readers     reads/s  per reader    writes/s\n");
+    for (n = 1; n <= max_readers; ++n)
+    {
+        atomic_store(&stop, 0);
+        for (i = 0; i <= n; ++i)
+        {
+            workers[i].ops = 0;
+            workers[i].seed = i * 7919;
+            pthread_create(&workers[i].tid, NULL, i == 0 ? writer : reader, &workers[i]);
+        }
+        sleep(SECONDS);
+        atomic_store(&stop, 1);
+
+        reads = 0;
+        for (i = 0; i <= n; ++i)
+        {
+            pthread_join(workers[i].tid, NULL);
+            if (i > 0)
+            {
+                reads += workers[i].ops;
+            }
+        }
+        printf("%7d %11lu %11lu %11lu\n", n, reads / SECONDS, reads / SECONDS / n,
+               workers[0].ops / SECONDS);
+    }
+
+    free(workers);
+    close(fd);
+    return 0;
+}
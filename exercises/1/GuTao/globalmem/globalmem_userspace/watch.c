@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "globalmem.h"
+
+/*
+ * Like read, but sleeps in GLOBALMEM_WAIT and only prints [offset, offset + 64)
+ * again after someone stored to it.  usage: watch [offset]
+ */
+
+int main(int argc, char **argv)
+{
+    struct globalmem_wait wait = { 0 };
+    unsigned char buffer[64];
+    ssize_t n = 0;
+    int i = 0;
+    int fd = open("/dev/globalmem", O_RDONLY);
+
+    if (fd < 0)
+    {
+        perror("open /dev/globalmem");
+        return 1;
+    }
+
+    wait.offset = argc > 1 ? strtoull(argv[1], NULL, 0) : 0;
+    wait.length = sizeof(buffer);
+    wait.timeout_ms = -1;
+    for (;;)
+    {
+        /* the gen we get back predates the pread, so nothing slips between */
+        if (ioctl(fd, GLOBALMEM_WAIT, &wait) < 0)
+        {
+            perror("GLOBALMEM_WAIT");
+            break;
+        }
+        n = pread(fd, buffer, sizeof(buffer), wait.offset);
+        if (n < 0)
+        {
+            perror("pread");
+            break;
+        }
+
+        printf("gen %llu:", (unsigned long long)wait.gen);
+        for (i = 0; i < n; ++i)
+        {
+            printf("%s0x%.2x", i % 8 ? " " : "\n", buffer[i]);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    close(fd);
+    return 0;
+}
@@ -5,46 +5,366 @@
 #include <linux/fs.h>            
 #include <asm/uaccess.h>          
 #include <linux/mutex.h>	       
+#include <linux/wait.h>               ///< Readers sleep until data arrives
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/mm.h>                 ///< kvmalloc() for rings of many MiB
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/percpu.h>             ///< Per-CPU staging rings in mpsc mode
+#include "zfxor.h"                ///< zf_xor() shared 0x55 transform
+#include "zfchar.h"               ///< ioctl numbers shared with userspace
+#include <linux/jump_label.h>         ///< Static key behind ZF_DBG()
+#define CREATE_TRACE_POINTS
+#include "zfchar_trace.h"         ///< enqueue/dequeue/full/empty/wakeup tracepoints
 #define  DEVICE_NAME "zfchar"   
 #define  CLASS_NAME  "zf"       
-#define BUFFER_LENGTH 256        
+#define RING_MIN_SIZE 64                   ///< Smallest ring ZFCHAR_SET_RING_SIZE or ring_size accepts
+#define RING_MAX_SIZE (64 * 1024 * 1024)   ///< Largest one, a power of two
 
 MODULE_LICENSE("GPL");           
 MODULE_AUTHOR("Great Wall");    
 MODULE_DESCRIPTION("A simple Linux char driver for the ZF");  
 MODULE_VERSION("0.1");            
 
+static unsigned int ring_size = 4096;       ///< Initial ring capacity, rounded up to a power of two
+module_param(ring_size, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Initial ring capacity in bytes, adjustable with ZFCHAR_SET_RING_SIZE");
+
+/// Who gets the bytes in the ring:
+/// 0 - the readers share one stream, each byte goes to whichever reader reads it first
+/// 1 - broadcast, every reader gets the whole stream; room is only reclaimed once the
+///     slowest reader has read it, so writers wait for that reader
+/// 2 - broadcast, writers never wait and overwrite the oldest bytes; a reader that falls
+///     more than a ring behind skips ahead and loses what it missed
+static unsigned int broadcast = 0;
+module_param(broadcast, uint, S_IRUGO);
+MODULE_PARM_DESC(broadcast, "0 shared stream, 1 broadcast held back by the slowest reader, 2 broadcast overwriting the oldest bytes");
+
+#define BROADCAST_SLOWEST 1
+#define BROADCAST_OVERWRITE 2
+
+/// Record mode: every write() is one message, stored after its length as a host-endian
+/// __u16. read() hands out whole messages in that same framing, as many as fit.
+static bool record = false;
+module_param(record, bool, S_IRUGO);
+MODULE_PARM_DESC(record, "Keep message boundaries, read() returns length-prefixed messages");
+
+#define RECORD_HDR sizeof(__u16)   ///< Length prefix of a record
+#define RECORD_MAX 0xffff          ///< Longest record payload
+
+/// Multi-producer mode: each write goes to a staging ring of the CPU it runs on and takes
+/// a number from one global sequence. dev_read merges the staging rings back into
+/// sequence order, so readers still see the writes in the order they were made while
+/// writers on different CPUs only share the sequence counter.
+static bool mpsc = false;
+module_param(mpsc, bool, S_IRUGO);
+MODULE_PARM_DESC(mpsc, "Per-CPU staging rings merged in write order, for many concurrent writers");
+
+/// Per-call debug messages. Off, each ZF_DBG() is a single patched-out jump, so the
+/// data path pays nothing for them. Toggle with /sys/module/zfchar/parameters/debug.
+static DEFINE_STATIC_KEY_FALSE(zfchar_debug_key);
+
+#define ZF_DBG(fmt, ...) \
+   do { \
+      if (static_branch_unlikely(&zfchar_debug_key)) \
+         printk(KERN_DEBUG "ZFChar: " fmt, ##__VA_ARGS__); \
+   } while (0)
+
+static int zfchar_set_debug(const char *val, const struct kernel_param *kp){
+   bool enable;
+   int ret = kstrtobool(val, &enable);
+
+   if (ret){
+      return ret;
+   }
+   if (enable){
+      static_branch_enable(&zfchar_debug_key);
+   }
+   else{
+      static_branch_disable(&zfchar_debug_key);
+   }
+   return 0;
+}
+
+static int zfchar_get_debug(char *buffer, const struct kernel_param *kp){
+   return sprintf(buffer, "%c\n", static_key_enabled(&zfchar_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops zfchar_debug_ops = {
+   .set = zfchar_set_debug,
+   .get = zfchar_get_debug,
+};
+module_param_cb(debug, &zfchar_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Print a debug message for every open, read, write and close");
+
 static int    majorNumber;                  ///< Store the device number -- determined automatically
-static char   message[BUFFER_LENGTH] = {0}; ///< Memory for the string that is passed from userspace
-static short  size_of_message = 0;          ///< Used to remember the size of the string stored
-static short  head = 0;                     ///< Head of the message array
-static short  tail = 0;                     ///< Tail of the message array
+
+/// Single-producer/single-consumer ring. head and tail run freely and are masked on use,
+/// so head - tail is the fill level. Each has its own cache line so the producer and the
+/// consumer don't bounce one line between them. message and mask only change under both
+/// mutexes, see zfchar_resize().
+static struct {
+   char *message;                                  ///< Ring storage for the encrypted bytes
+   unsigned int mask;                              ///< Capacity - 1, capacity is a power of two
+   unsigned int head ____cacheline_aligned_in_smp; ///< Bytes ever written, stored by dev_write only
+   unsigned int tail ____cacheline_aligned_in_smp; ///< Bytes ever read, stored by dev_read only;
+                                                   ///< in broadcast mode the slowest cursor, or
+                                                   ///< in overwrite mode the oldest byte not yet overwritten
+} ring;
+
+/// A reader in broadcast mode, hung off filep->private_data
+struct zfchar_reader {
+   struct list_head node;   ///< On zfchar_readers
+   unsigned int cursor;     ///< Next byte this reader gets, never behind ring.tail unless overwritten
+};
+
+static LIST_HEAD(zfchar_readers);   ///< Broadcast readers, under zfchar_read_mutex
 static int    numberOpens = 0;              ///< Counts the number of times the device is opened
 static struct class*  zfcharClass  = NULL; ///< The device-driver class struct pointer
 static struct device* zfcharDevice = NULL; ///< The device-driver device struct pointer
 
-static DEFINE_MUTEX(zfchar_mutex);	    ///< Macro to declare a new mutex
+/// Writers are serialized among themselves, and so are readers, which keeps the ring
+/// single-producer/single-consumer without a lock shared between the two sides.
+/// Anything taking both takes the write mutex first. In broadcast mode the read mutex
+/// also guards zfchar_readers and every cursor.
+static DEFINE_MUTEX(zfchar_write_mutex);
+static DEFINE_MUTEX(zfchar_read_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(zfchar_readq); ///< Readers waiting for the ring to fill
+static DECLARE_WAIT_QUEUE_HEAD(zfchar_writeq); ///< Writers waiting for room
+
+/// What precedes every write in a staging ring
+struct zfchar_entry {
+   unsigned int seq;   ///< Position in zfchar_seq order
+   unsigned int len;   ///< Payload bytes; 0 for a write that faulted after taking its seq
+};
+
+/// A per-CPU staging ring, laid out like ring with ring_size bytes of its own. Writers
+/// that land on the same CPU serialize on lock, the consumer side is zfchar_read_mutex.
+struct zfchar_stage {
+   struct mutex lock;
+   char *message;
+   unsigned int head ____cacheline_aligned_in_smp; ///< Stored by writers under lock
+   unsigned int tail ____cacheline_aligned_in_smp; ///< Stored by dev_read under zfchar_read_mutex
+};
+
+static DEFINE_PER_CPU(struct zfchar_stage, zfchar_stages);
+static atomic_t zfchar_seq = ATOMIC_INIT(0);   ///< Next sequence number a write takes
+static unsigned int zfchar_next_seq;           ///< Next one dev_read hands out, under zfchar_read_mutex
+static unsigned int zfchar_entry_off;          ///< Payload of that entry already read
 
 /// The prototype functions for the character driver -- must come before the struct definition
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+static unsigned int dev_poll(struct file *, poll_table *);
 
 static struct file_operations fops =
 {
    .open = dev_open,
    .read = dev_read,
    .write = dev_write,
+   .unlocked_ioctl = dev_ioctl,
+   .compat_ioctl = dev_ioctl,
+   .poll = dev_poll,
    .release = dev_release,
 };
 
+/// Staging ring copies, in both directions and across the end of the storage
+static void stage_put(struct zfchar_stage *stage, unsigned int pos, const void *from, size_t n){
+   size_t n1 = min_t(size_t, n, ring.mask + 1 - (pos & ring.mask));
+
+   memcpy(stage->message + (pos & ring.mask), from, n1);
+   memcpy(stage->message, (const char *)from + n1, n - n1);
+}
+
+static void stage_get(struct zfchar_stage *stage, unsigned int pos, void *to, size_t n){
+   size_t n1 = min_t(size_t, n, ring.mask + 1 - (pos & ring.mask));
+
+   memcpy(to, stage->message + (pos & ring.mask), n1);
+   memcpy((char *)to + n1, stage->message, n - n1);
+}
+
+static unsigned int stage_room(struct zfchar_stage *stage){
+   return ring.mask + 1 - (READ_ONCE(stage->head) - smp_load_acquire(&stage->tail));
+}
+
+/// The stage holding entry zfchar_next_seq, with its header in *entry, or NULL while that
+/// write hasn't been published yet. Within a stage the seqs only grow, so only the oldest
+/// entry of each needs a look.
+static struct zfchar_stage *zfchar_next_stage(struct zfchar_entry *entry){
+   struct zfchar_stage *stage;
+   int cpu;
+
+   for_each_possible_cpu(cpu){
+      stage = per_cpu_ptr(&zfchar_stages, cpu);
+      if (smp_load_acquire(&stage->head) == READ_ONCE(stage->tail)){
+         continue;
+      }
+      stage_get(stage, READ_ONCE(stage->tail), entry, sizeof(*entry));
+      if (entry->seq == READ_ONCE(zfchar_next_seq)){
+         return stage;
+      }
+   }
+   return NULL;
+}
+
+/// Queued bytes and free bytes, for wait conditions and poll. Good for a moment only
+/// unless the caller holds the mutex of the side that would change them.
+static unsigned int ring_used(void){
+   return smp_load_acquire(&ring.head) - READ_ONCE(ring.tail);
+}
+
+static unsigned int ring_room(void){
+   if (mpsc){
+      return stage_room(raw_cpu_ptr(&zfchar_stages));   // where a write from here would go, for poll
+   }
+   if (broadcast == BROADCAST_OVERWRITE){
+      return READ_ONCE(ring.mask) + 1;   // there is always room, at somebody's expense
+   }
+   return READ_ONCE(ring.mask) + 1 - (READ_ONCE(ring.head) - smp_load_acquire(&ring.tail));
+}
+
+/// Bytes waiting for this file: its own cursor in broadcast mode, the shared tail otherwise
+static unsigned int ring_pending(struct file *filep){
+   struct zfchar_reader *reader = smp_load_acquire(&filep->private_data);   // set by a concurrent first read()
+   struct zfchar_entry entry;
+   unsigned int pending;
+
+   if (mpsc){
+      // the stage tails and zfchar_next_seq move together only under the read mutex, a
+      // peek without it can miss the next entry and sleep through its wakeup. This runs
+      // as a wait condition, so only trylock; a busy mutex means another reader is
+      // taking entries, say pending and let the caller find out under the mutex
+      if (!mutex_trylock(&zfchar_read_mutex)){
+         return 1;
+      }
+      pending = zfchar_next_stage(&entry) ? 1 : 0;   // something is readable, not how much
+      mutex_unlock(&zfchar_read_mutex);
+      return pending;
+   }
+
+   if (!reader){
+      return ring_used();
+   }
+   return smp_load_acquire(&ring.head) - READ_ONCE(reader->cursor);
+}
+
+/// Broadcast mode: reclaim what every reader has read. The cursors only move forward, so
+/// neither does the tail. Once the last reader is gone nobody is owed the backlog, so it
+/// is dropped; what is written after that waits for the next reader. Called with
+/// zfchar_read_mutex held.
+static void zfchar_update_tail(void){
+   struct zfchar_reader *reader;
+   unsigned int hd = smp_load_acquire(&ring.head);
+   unsigned int lag = 0;
+
+   if (broadcast != BROADCAST_SLOWEST){
+      return;
+   }
+   list_for_each_entry(reader, &zfchar_readers, node){
+      lag = max(lag, hd - reader->cursor);
+   }
+   if (hd - lag != ring.tail){
+      smp_store_release(&ring.tail, hd - lag);
+      if (wq_has_sleeper(&zfchar_writeq)){
+         trace_zfchar_wakeup(true, lag);
+         wake_up_interruptible(&zfchar_writeq);
+      }
+   }
+}
+
+/// Record mode: the length prefix at index pos, byte by byte since it may wrap
+static void ring_put_len(unsigned int pos, __u16 len){
+   const char *b = (const char *)&len;
+
+   ring.message[pos & ring.mask] = b[0];
+   ring.message[(pos + 1) & ring.mask] = b[1];
+}
+
+static __u16 ring_get_len(unsigned int pos){
+   __u16 len;
+   char *b = (char *)&len;
+
+   b[0] = ring.message[pos & ring.mask];
+   b[1] = ring.message[(pos + 1) & ring.mask];
+   return len;
+}
+
+/// Capacity for a requested size: the next power of two. Sizes outside
+/// [RING_MIN_SIZE, RING_MAX_SIZE] are refused with -EINVAL, not clamped.
+static int ring_capacity(unsigned int size, unsigned int *capacity){
+   if (size < RING_MIN_SIZE || size > RING_MAX_SIZE){
+      return -EINVAL;
+   }
+   *capacity = roundup_pow_of_two(size);
+   return 0;
+}
+
+/// The ring, or in mpsc mode one staging ring per CPU, each of the given capacity
+static int zfchar_alloc_storage(unsigned int capacity){
+   struct zfchar_stage *stage;
+   int cpu;
+
+   ring.mask = capacity - 1;
+   if (!mpsc){
+      ring.message = kvmalloc(capacity, GFP_KERNEL);
+      return ring.message ? 0 : -ENOMEM;
+   }
+   for_each_possible_cpu(cpu){
+      stage = per_cpu_ptr(&zfchar_stages, cpu);
+      mutex_init(&stage->lock);
+      stage->message = kvmalloc(capacity, GFP_KERNEL);
+      if (!stage->message){
+         return -ENOMEM;   // zfchar_free_storage() takes back the ones that worked
+      }
+   }
+   return 0;
+}
+
+static void zfchar_free_storage(void){
+   int cpu;
+
+   kvfree(ring.message);
+   for_each_possible_cpu(cpu){
+      kvfree(per_cpu_ptr(&zfchar_stages, cpu)->message);
+   }
+}
+
 static int __init zfchar_init(void){
+   unsigned int capacity;
+
    printk(KERN_INFO "ZFChar: Initializing the ZFChar LKM\n");
 
+   if (ring_capacity(ring_size, &capacity)){
+      printk(KERN_ALERT "ZFChar: ring_size must be %u..%u\n", RING_MIN_SIZE, RING_MAX_SIZE);
+      return -EINVAL;
+   }
+
+   if (record && broadcast == BROADCAST_OVERWRITE){
+      // an overwrite can land in the middle of a record, and lapped readers lose the framing
+      printk(KERN_ALERT "ZFChar: record mode doesn't work with broadcast=2\n");
+      return -EINVAL;
+   }
+
+   if (mpsc && broadcast){
+      // the merge hands every write out once, there is no per-reader cursor to keep
+      printk(KERN_ALERT "ZFChar: mpsc mode doesn't work with broadcast\n");
+      return -EINVAL;
+   }
+
+   if (zfchar_alloc_storage(capacity)){
+      zfchar_free_storage();
+      return -ENOMEM;
+   }
+
    // Try to dynamically allocate a major number for the device
    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
    if (majorNumber<0){
+      zfchar_free_storage();
       printk(KERN_ALERT "ZFChar failed to register a major number\n");
       return majorNumber;
    }
@@ -54,6 +374,7 @@ static int __init zfchar_init(void){
    zfcharClass = class_create(THIS_MODULE, CLASS_NAME);
    if (IS_ERR(zfcharClass)){           // Check for error and clean up if there is
       unregister_chrdev(majorNumber, DEVICE_NAME);
+      zfchar_free_storage();
       printk(KERN_ALERT "Failed to register device class\n");
       return PTR_ERR(zfcharClass);     // Correct way to return an error on a pointer
    }
@@ -64,78 +385,527 @@ static int __init zfchar_init(void){
    if (IS_ERR(zfcharDevice)){          // Clean up if there is an error
       class_destroy(zfcharClass);      // Repeated code but the alternative is goto statements
       unregister_chrdev(majorNumber, DEVICE_NAME);
+      zfchar_free_storage();
       printk(KERN_ALERT "Failed to create the device\n");
       return PTR_ERR(zfcharDevice);
    }
    printk(KERN_INFO "ZFChar: device class created correctly\n"); // Made it! device was initialized
-   mutex_init(&zfchar_mutex);          // Initialize the mutex dynamically
+   mutex_init(&zfchar_write_mutex);    // Initialize the mutexes dynamically
+   mutex_init(&zfchar_read_mutex);
    return 0;
 }
 
 static void __exit zfchar_exit(void){
-   mutex_destroy(&zfchar_mutex);                       // destroy the dynamically-allocated mutex
+   mutex_destroy(&zfchar_read_mutex);                  // destroy the dynamically-allocated mutexes
+   mutex_destroy(&zfchar_write_mutex);
    device_destroy(zfcharClass, MKDEV(majorNumber, 0)); // remove the device
    class_unregister(zfcharClass);                      // unregister the device class
    class_destroy(zfcharClass);                         // remove the device class
    unregister_chrdev(majorNumber, DEVICE_NAME);         // unregister the major number
+   zfchar_free_storage();                              // free the ring storage
    printk(KERN_INFO "ZFChar: Goodbye from the LKM!\n");
 }
 
 static int dev_open(struct inode *inodep, struct file *filep){
    numberOpens++;
-   printk(KERN_INFO "ZFChar: Device has been opened %d time(s)\n", numberOpens);
+   ZF_DBG("Device has been opened %d time(s)\n", numberOpens);
    return 0;
 }
 
+/// mpsc mode read: hands out the staged writes in sequence order, waiting for the next
+/// one to be published if it isn't yet. Blocks like dev_read when nothing is staged.
+static ssize_t zfchar_read_staged(struct file *filep, char *buffer, size_t len){
+   struct zfchar_stage *stage;
+   struct zfchar_entry entry;
+   size_t rdlen, n1, n;
+   unsigned int pos;
+   ssize_t ret;
+   __u16 reclen;
+
+again:
+   rdlen = 0;
+   ret = 0;
+   for (;;){
+      if (mutex_lock_interruptible(&zfchar_read_mutex)){
+         return -ERESTARTSYS;
+      }
+      stage = zfchar_next_stage(&entry);
+      if (stage){
+         break;
+      }
+      mutex_unlock(&zfchar_read_mutex);
+      trace_zfchar_empty(READ_ONCE(ring.mask) + 1);
+      if (filep->f_flags & O_NONBLOCK){
+         return -EAGAIN;
+      }
+      if (wait_event_interruptible(zfchar_readq, ring_pending(filep) > 0)){
+         return -ERESTARTSYS;
+      }
+   }
+
+   do{
+      if (record && entry.len){
+         // whole records in the same framing as the single ring, the header first
+         if (rdlen + RECORD_HDR + entry.len > len){
+            ret = -EMSGSIZE;
+            break;
+         }
+         reclen = entry.len;
+         if (copy_to_user(buffer + rdlen, &reclen, RECORD_HDR)){
+            ret = -EFAULT;
+            break;
+         }
+         n = entry.len;
+         rdlen += RECORD_HDR;
+      }
+      else{
+         n = min_t(size_t, len - rdlen, entry.len - zfchar_entry_off);
+      }
+
+      pos = stage->tail + sizeof(entry) + zfchar_entry_off;
+      n1 = min_t(size_t, n, ring.mask + 1 - (pos & ring.mask));
+      if (copy_to_user(buffer + rdlen, stage->message + (pos & ring.mask), n1) ||
+          copy_to_user(buffer + rdlen + n1, stage->message, n - n1)){
+         if (record && entry.len){
+            rdlen -= RECORD_HDR;   // the header alone isn't a record
+         }
+         ret = -EFAULT;
+         break;
+      }
+      rdlen += n;
+      zfchar_entry_off += n;
+
+      if (zfchar_entry_off == entry.len){
+         // the whole entry is out, give its room back to the writers on that CPU
+         smp_store_release(&stage->tail, stage->tail + sizeof(entry) + entry.len);
+         zfchar_entry_off = 0;
+         WRITE_ONCE(zfchar_next_seq, zfchar_next_seq + 1);
+      }
+   } while (rdlen < len && (stage = zfchar_next_stage(&entry)));
+   mutex_unlock(&zfchar_read_mutex);
+
+   if (wq_has_sleeper(&zfchar_writeq)){
+      trace_zfchar_wakeup(true, 0);
+      wake_up_interruptible(&zfchar_writeq);
+   }
+   if (rdlen == 0){
+      // the user buffer faulted or the first record doesn't fit, or all there was were
+      // writes that faulted themselves, which leave nothing to read
+      if (ret){
+         return ret;
+      }
+      goto again;
+   }
+   trace_zfchar_dequeue(rdlen, 0);
+   ZF_DBG("Sent %zu staged characters to the user\n", rdlen);
+   return rdlen;
+}
+
+/// Broadcast mode: the file's cursor, added on its first read() rather than at open, so
+/// a file opened O_RDWR only to write never holds ring.tail back. It starts with whatever
+/// is still queued at that point.
+static struct zfchar_reader *zfchar_get_reader(struct file *filep){
+   struct zfchar_reader *reader = smp_load_acquire(&filep->private_data);
+
+   if (reader){
+      return reader;
+   }
+   reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+   if (!reader){
+      return ERR_PTR(-ENOMEM);
+   }
+   mutex_lock(&zfchar_read_mutex);
+   if (filep->private_data){
+      // another read() on this file got here first
+      kfree(reader);
+      reader = filep->private_data;
+   }
+   else{
+      reader->cursor = ring.tail;
+      list_add_tail(&reader->node, &zfchar_readers);
+      smp_store_release(&filep->private_data, reader);
+   }
+   mutex_unlock(&zfchar_read_mutex);
+   return reader;
+}
+
+/// Blocks until the ring holds data, unless the file is O_NONBLOCK. In broadcast mode
+/// each reader moves its own cursor, otherwise they all share ring.tail.
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
+   struct zfchar_reader *reader = NULL;
    int error_count1 = 0, error_count2 = 0;
-   int rdlen = len <= size_of_message ? len : size_of_message;
-   int rdlen1 = tail + rdlen < BUFFER_LENGTH ? rdlen : BUFFER_LENGTH - tail;
-   int rdlen2 = rdlen - rdlen1;
+   unsigned int hd, tl;
+   size_t rdlen, rdlen1, rdlen2;
+
+   if (len == 0){
+      return 0;
+   }
+   if (mpsc){
+      return zfchar_read_staged(filep, buffer, len);
+   }
+   if (broadcast){
+      reader = zfchar_get_reader(filep);
+      if (IS_ERR(reader)){
+         return PTR_ERR(reader);
+      }
+   }
+
+again:
+   for (;;){
+      if (mutex_lock_interruptible(&zfchar_read_mutex)){
+         return -ERESTARTSYS;
+      }
+      hd = smp_load_acquire(&ring.head);   // pairs with dev_write, the bytes below head are there
+      tl = reader ? reader->cursor : ring.tail;
+      if (broadcast == BROADCAST_OVERWRITE && (int)(READ_ONCE(ring.tail) - tl) > 0){
+         ZF_DBG("reader lapped, lost %u bytes\n", READ_ONCE(ring.tail) - tl);
+         tl = READ_ONCE(ring.tail);
+         reader->cursor = tl;
+      }
+      if (hd != tl){
+         break;
+      }
+      // never sleep with the mutex held, another reader or a resize may want it
+      mutex_unlock(&zfchar_read_mutex);
+      trace_zfchar_empty(READ_ONCE(ring.mask) + 1);
+      if (filep->f_flags & O_NONBLOCK){
+         return -EAGAIN;
+      }
+      if (wait_event_interruptible(zfchar_readq, ring_pending(filep) > 0)){
+         return -ERESTARTSYS;
+      }
+   }
 
-   printk(KERN_INFO "ZFChar: tail is %d, rdlen is %d, rdlen1 is %d, rdlen2 is %d\n", tail , rdlen, rdlen1, rdlen2);
+   if (record){
+      // whole records only, as many as the buffer takes, framing and all
+      for (rdlen = 0; tl + rdlen != hd; rdlen += RECORD_HDR + ring_get_len(tl + rdlen)){
+         if (rdlen + RECORD_HDR + ring_get_len(tl + rdlen) > len){
+            break;
+         }
+      }
+      if (rdlen == 0){
+         mutex_unlock(&zfchar_read_mutex);
+         return -EMSGSIZE;
+      }
+   }
+   else{
+      rdlen = min_t(size_t, len, hd - tl);
+   }
+   rdlen1 = min_t(size_t, rdlen, ring.mask + 1 - (tl & ring.mask));
+   rdlen2 = rdlen - rdlen1;
+
+   ZF_DBG("tail is %u, rdlen is %zu, rdlen1 is %zu, rdlen2 is %zu\n", tl, rdlen, rdlen1, rdlen2);
 
    // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count1 = copy_to_user(buffer, message + tail, rdlen1);
-   error_count2 = copy_to_user(buffer + rdlen1, message, rdlen2);
-   
-   tail += rdlen;
-   tail %= BUFFER_LENGTH;
-   size_of_message -= rdlen;
-   printk(KERN_INFO "ZFChar: Sent %d characters to the user and remain len is %d\n", rdlen, size_of_message);
-   return rdlen; // clear the position to the start and return 0
+   error_count1 = copy_to_user(buffer, ring.message + (tl & ring.mask), rdlen1);
+   error_count2 = copy_to_user(buffer + rdlen1, ring.message, rdlen2);
+   if (error_count1 || error_count2){
+      mutex_unlock(&zfchar_read_mutex);
+      return -EFAULT;
+   }
+
+   if (broadcast == BROADCAST_OVERWRITE){
+      // a writer moves the tail before it overwrites, so if the tail is still behind us
+      // nothing we copied was torn; otherwise throw the copy away and start over
+      smp_rmb();
+      if ((int)(READ_ONCE(ring.tail) - tl) > 0){
+         mutex_unlock(&zfchar_read_mutex);
+         goto again;
+      }
+   }
 
+   if (reader){
+      reader->cursor = tl + rdlen;
+      zfchar_update_tail();
+      mutex_unlock(&zfchar_read_mutex);
+   }
+   else{
+      smp_store_release(&ring.tail, tl + rdlen);   // give the space back only once it's copied out
+      mutex_unlock(&zfchar_read_mutex);
+
+      if (wq_has_sleeper(&zfchar_writeq)){
+         trace_zfchar_wakeup(true, hd - tl - rdlen);
+         wake_up_interruptible(&zfchar_writeq);
+      }
+   }
+   trace_zfchar_dequeue(rdlen, hd - tl - rdlen);
+   ZF_DBG("Sent %zu characters to the user\n", rdlen);
+   return rdlen;
 }
 
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
-   int i = 0, j = 0;
-   int wtlen = len <= (BUFFER_LENGTH - size_of_message) ? len : (BUFFER_LENGTH - size_of_message);
-   
-   int wtlen1 = BUFFER_LENGTH - head <= wtlen ? BUFFER_LENGTH - head : wtlen;
-   int wtlen2 = wtlen - wtlen1;
+/// Queues as much of buffer as fits right now, 0 when the ring is full. In record mode
+/// buffer is one message and goes in whole or not at all.
+static ssize_t zfchar_push(const char *buffer, size_t len){
+   int error_count1 = 0, error_count2 = 0;
+   unsigned int hd, tl, pos;
+   size_t wtlen, wtlen1, wtlen2;
 
-   printk(KERN_INFO "ZFChar: head is %d\n", head);
-   for (i = head; i < head + wtlen1; i++){
-      message[i] = buffer[j] ^ 0x55;
-      j++;
+   if (mutex_lock_interruptible(&zfchar_write_mutex)){
+      return -ERESTARTSYS;
    }
+   hd = ring.head;
+   tl = smp_load_acquire(&ring.tail);   // pairs with dev_read, it is done with the bytes below tail
+   if (broadcast == BROADCAST_OVERWRITE){
+      wtlen = min_t(size_t, len, ring.mask + 1);
+      if ((int)(hd + wtlen - tl) > (int)(ring.mask + 1)){
+         // retire the bytes about to be overwritten before touching them, dev_read
+         // checks the tail after copying to catch exactly this
+         tl = hd + wtlen - (ring.mask + 1);
+         WRITE_ONCE(ring.tail, tl);
+         smp_wmb();
+      }
+   }
+   else if (record){
+      if (len > RECORD_MAX || RECORD_HDR + len > ring.mask + 1){
+         mutex_unlock(&zfchar_write_mutex);
+         return -EMSGSIZE;
+      }
+      wtlen = RECORD_HDR + len <= ring.mask + 1 - (hd - tl) ? len : 0;
+   }
+   else{
+      wtlen = min_t(size_t, len, ring.mask + 1 - (hd - tl));
+   }
+   if (wtlen == 0){
+      mutex_unlock(&zfchar_write_mutex);
+      return 0;
+   }
+
+   pos = hd;
+   if (record){
+      ring_put_len(pos, wtlen);
+      pos += RECORD_HDR;
+   }
+   wtlen1 = min_t(size_t, wtlen, ring.mask + 1 - (pos & ring.mask));
+   wtlen2 = wtlen - wtlen1;
 
-   for (i = 0; i < wtlen2; i++){
-      message[i] = buffer[j] ^ 0x55;
-      j++;
+   ZF_DBG("head is %u\n", hd);
+   // copy both pieces into the ring first, then encrypt them in place a word at a time
+   error_count1 = copy_from_user(ring.message + (pos & ring.mask), buffer, wtlen1);
+   error_count2 = copy_from_user(ring.message, buffer + wtlen1, wtlen2);
+   if (error_count1 || error_count2){
+      mutex_unlock(&zfchar_write_mutex);
+      return -EFAULT;
    }
+   zf_xor(ring.message + (pos & ring.mask), ring.message + (pos & ring.mask), wtlen1, ZF_XOR_KEY);
+   zf_xor(ring.message, ring.message, wtlen2, ZF_XOR_KEY);
 
-   head += wtlen;
-   head %= BUFFER_LENGTH;
+   smp_store_release(&ring.head, pos + wtlen);   // publish the bytes only once they're encrypted
+   mutex_unlock(&zfchar_write_mutex);
+   trace_zfchar_enqueue(wtlen, pos + wtlen - tl);
 
-   size_of_message += wtlen;                         // store the length of the stored message
-   printk(KERN_INFO "ZFChar: Received %zu characters from the user, stored %d characters in array and total len is %d\n", len, wtlen, size_of_message);
+   // wq_has_sleeper() orders the head store against a reader about to sleep
+   if (wq_has_sleeper(&zfchar_readq)){
+      trace_zfchar_wakeup(false, pos + wtlen - tl);
+      wake_up_interruptible(&zfchar_readq);
+   }
+   ZF_DBG("Received %zu characters from the user, stored %zu characters in array and total len is %u\n", len, wtlen, pos + wtlen - tl);
    return wtlen;
 }
 
+/// mpsc mode counterpart of zfchar_push: stages as much of buffer as fits in the ring of
+/// the current CPU as one entry. The seq is only taken once the room is there, so every
+/// seq taken gets published promptly and dev_read never waits on a writer that waits on it.
+static ssize_t zfchar_stage_push(struct zfchar_stage *stage, const char *buffer, size_t len){
+   struct zfchar_entry entry;
+   unsigned int hd, tl, room, pos;
+   size_t wtlen, wtlen1;
+
+   if (mutex_lock_interruptible(&stage->lock)){
+      return -ERESTARTSYS;
+   }
+   hd = stage->head;
+   tl = smp_load_acquire(&stage->tail);
+   room = ring.mask + 1 - (hd - tl);
+   if (record && (len > RECORD_MAX || sizeof(entry) + len > ring.mask + 1)){
+      mutex_unlock(&stage->lock);
+      return -EMSGSIZE;
+   }
+   if (room <= sizeof(entry)){
+      wtlen = 0;
+   }
+   else if (record){
+      wtlen = sizeof(entry) + len <= room ? len : 0;
+   }
+   else{
+      wtlen = min_t(size_t, len, room - sizeof(entry));
+   }
+   if (wtlen == 0){
+      mutex_unlock(&stage->lock);
+      return 0;
+   }
+
+   entry.seq = atomic_inc_return(&zfchar_seq) - 1;
+   entry.len = wtlen;
+   pos = hd + sizeof(entry);
+   wtlen1 = min_t(size_t, wtlen, ring.mask + 1 - (pos & ring.mask));
+   if (copy_from_user(stage->message + (pos & ring.mask), buffer, wtlen1) ||
+       copy_from_user(stage->message, buffer + wtlen1, wtlen - wtlen1)){
+      entry.len = 0;   // still publish the seq, the reader would wait for it forever
+   }
+   zf_xor(stage->message + (pos & ring.mask), stage->message + (pos & ring.mask), min_t(size_t, entry.len, wtlen1), ZF_XOR_KEY);
+   if (entry.len > wtlen1){
+      zf_xor(stage->message, stage->message, entry.len - wtlen1, ZF_XOR_KEY);
+   }
+   stage_put(stage, hd, &entry, sizeof(entry));
+
+   smp_store_release(&stage->head, pos + entry.len);
+   mutex_unlock(&stage->lock);
+   trace_zfchar_enqueue(entry.len, pos + entry.len - tl);
+
+   if (wq_has_sleeper(&zfchar_readq)){
+      trace_zfchar_wakeup(false, pos + entry.len - tl);
+      wake_up_interruptible(&zfchar_readq);
+   }
+   return entry.len ? wtlen : -EFAULT;
+}
+
+/// Blocks until all of buffer is queued, unless the file is O_NONBLOCK. Like a pipe write
+/// over PIPE_BUF, a write that has to wait for room may interleave with other writers;
+/// in record mode it never does, the message waits until it fits whole.
+static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
+   struct zfchar_stage *stage = NULL;
+   size_t written = 0;
+   size_t need = record ? RECORD_HDR + len : 1;   // room a retry needs
+   ssize_t ret = 0;
+
+   if (mpsc){
+      // one stage for the whole write, so the wait below is for the stage we push into;
+      // migrating afterwards is fine
+      stage = raw_cpu_ptr(&zfchar_stages);
+      need = sizeof(struct zfchar_entry) + (record ? len : 1);
+   }
+   while (written < len){
+      ret = stage ? zfchar_stage_push(stage, buffer + written, len - written) : zfchar_push(buffer + written, len - written);
+      if (ret < 0){
+         break;
+      }
+      written += ret;
+      if (ret > 0){
+         continue;
+      }
+
+      // the ring is full, wait for dev_read to free some of it
+      trace_zfchar_full(READ_ONCE(ring.mask) + 1);
+      if (filep->f_flags & O_NONBLOCK){
+         ret = -EAGAIN;
+         break;
+      }
+      // a shrink may leave a record too big for the ring, zfchar_push then says -EMSGSIZE
+      if (wait_event_interruptible(zfchar_writeq, (stage ? stage_room(stage) : ring_room()) >= need ||
+                                   need > READ_ONCE(ring.mask) + 1)){
+         ret = -ERESTARTSYS;
+         break;
+      }
+   }
+
+   return written ? written : ret;
+}
+
+/// Moves the queued bytes into a new ring of the given capacity. Readers and writers
+/// only wait on the mutexes for the duration of the copy, nothing queued is lost.
+static int zfchar_resize(unsigned int capacity){
+   struct zfchar_reader *reader;
+   unsigned int used, first;
+   char *message;
+
+   message = kvmalloc(capacity, GFP_KERNEL);   // before the locks, this may take a while
+   if (!message){
+      return -ENOMEM;
+   }
+
+   if (mutex_lock_interruptible(&zfchar_write_mutex)){
+      kvfree(message);
+      return -ERESTARTSYS;
+   }
+   if (mutex_lock_interruptible(&zfchar_read_mutex)){
+      mutex_unlock(&zfchar_write_mutex);
+      kvfree(message);
+      return -ERESTARTSYS;
+   }
+
+   used = ring.head - ring.tail;
+   if (used > capacity && broadcast == BROADCAST_OVERWRITE){
+      ring.tail = ring.head - capacity;   // keep the newest bytes, as a write would
+      used = capacity;
+   }
+   if (used > capacity){
+      mutex_unlock(&zfchar_read_mutex);
+      mutex_unlock(&zfchar_write_mutex);
+      kvfree(message);
+      return -EBUSY;
+   }
+
+   // unwrap the queued bytes to the start of the new storage
+   first = min(used, ring.mask + 1 - (ring.tail & ring.mask));
+   memcpy(message, ring.message + (ring.tail & ring.mask), first);
+   memcpy(message + first, ring.message, used - first);
+   swap(ring.message, message);
+   ring.mask = capacity - 1;
+   list_for_each_entry(reader, &zfchar_readers, node){
+      // the tail becomes 0, a cursor lapped in overwrite mode lands on it
+      WRITE_ONCE(reader->cursor, (int)(reader->cursor - ring.tail) > 0 ? reader->cursor - ring.tail : 0);
+   }
+   WRITE_ONCE(ring.tail, 0);   // sleeping readers peek at the indices without the mutex
+   WRITE_ONCE(ring.head, used);
+
+   mutex_unlock(&zfchar_read_mutex);
+   mutex_unlock(&zfchar_write_mutex);
+   kvfree(message);
+   wake_up_interruptible(&zfchar_writeq);   // a bigger ring may have room for them now
+   printk(KERN_INFO "ZFChar: ring resized to %u bytes, %u queued\n", capacity, used);
+   return 0;
+}
+
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   __u32 __user *argp = (__u32 __user *)arg;
+   __u32 size;
+   unsigned int capacity;
+
+   switch (cmd){
+   case ZFCHAR_SET_RING_SIZE:
+      if (get_user(size, argp)){
+         return -EFAULT;
+      }
+      if (mpsc){
+         return -EINVAL;   // the staging rings are sized once, at load time
+      }
+      if (ring_capacity(size, &capacity)){
+         return -EINVAL;
+      }
+      return zfchar_resize(capacity);
+   case ZFCHAR_GET_RING_SIZE:
+      return put_user(READ_ONCE(ring.mask) + 1, argp);
+   default:
+      return -ENOTTY;
+   }
+}
+
+static unsigned int dev_poll(struct file *filep, poll_table *wait){
+   unsigned int mask = 0;
+
+   poll_wait(filep, &zfchar_readq, wait);
+   poll_wait(filep, &zfchar_writeq, wait);
+   if (ring_pending(filep) > 0){
+      mask |= POLLIN | POLLRDNORM;
+   }
+   if (ring_room() > 0){
+      mask |= POLLOUT | POLLWRNORM;
+   }
+   return mask;
+}
+
 static int dev_release(struct inode *inodep, struct file *filep){
-   // mutex_unlock(&zfchar_mutex);                      // release the mutex (i.e., lock goes up)
-   printk(KERN_INFO "ZFChar: Device successfully closed\n");
+   struct zfchar_reader *reader = filep->private_data;
+
+   if (reader){
+      // the ring no longer has to keep what only this reader hadn't read
+      mutex_lock(&zfchar_read_mutex);
+      list_del(&reader->node);
+      zfchar_update_tail();
+      mutex_unlock(&zfchar_read_mutex);
+      kfree(reader);
+   }
+   ZF_DBG("Device successfully closed\n");
    return 0;
 }
 
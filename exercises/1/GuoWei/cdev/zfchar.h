@@ -0,0 +1,20 @@
+#ifndef _ZFCHAR_H_
+#define _ZFCHAR_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define ZFCHAR_MAGIC 'z'
+
+/// Ring capacity in bytes, 64 to 64 MiB, rounded up to a power of two; other sizes fail
+/// with EINVAL. Queued data is kept, so shrinking below what is queued fails with EBUSY.
+/// With broadcast=2 the oldest bytes are dropped instead, as a write would. A record
+/// writer waiting for room fails with EMSGSIZE once its message no longer fits.
+#define ZFCHAR_SET_RING_SIZE _IOW(ZFCHAR_MAGIC, 0, __u32)
+#define ZFCHAR_GET_RING_SIZE _IOR(ZFCHAR_MAGIC, 1, __u32)
+
+/// With record=1, read() returns whole messages, each as a host-endian __u16 length
+/// followed by that many bytes, as many as fit in the buffer
+#define ZFCHAR_RECORD_HDR sizeof(__u16)
+
+#endif
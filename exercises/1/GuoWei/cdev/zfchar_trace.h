@@ -0,0 +1,81 @@
+/// Tracepoints for the zfchar data path, a patched-out nop each until enabled with
+/// echo 1 > /sys/kernel/debug/tracing/events/zfchar/enable
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM zfchar
+
+#if !defined(_ZFCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ZFCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/// Bytes moved and the fill level after the move
+DECLARE_EVENT_CLASS(zfchar_io,
+   TP_PROTO(size_t len, unsigned int used),
+   TP_ARGS(len, used),
+   TP_STRUCT__entry(
+      __field(size_t, len)
+      __field(unsigned int, used)
+   ),
+   TP_fast_assign(
+      __entry->len = len;
+      __entry->used = used;
+   ),
+   TP_printk("len=%zu used=%u", __entry->len, __entry->used)
+);
+
+DEFINE_EVENT(zfchar_io, zfchar_enqueue,
+   TP_PROTO(size_t len, unsigned int used),
+   TP_ARGS(len, used)
+);
+
+DEFINE_EVENT(zfchar_io, zfchar_dequeue,
+   TP_PROTO(size_t len, unsigned int used),
+   TP_ARGS(len, used)
+);
+
+/// A writer found the ring full, or a reader found it empty
+DECLARE_EVENT_CLASS(zfchar_state,
+   TP_PROTO(unsigned int capacity),
+   TP_ARGS(capacity),
+   TP_STRUCT__entry(
+      __field(unsigned int, capacity)
+   ),
+   TP_fast_assign(
+      __entry->capacity = capacity;
+   ),
+   TP_printk("capacity=%u", __entry->capacity)
+);
+
+DEFINE_EVENT(zfchar_state, zfchar_full,
+   TP_PROTO(unsigned int capacity),
+   TP_ARGS(capacity)
+);
+
+DEFINE_EVENT(zfchar_state, zfchar_empty,
+   TP_PROTO(unsigned int capacity),
+   TP_ARGS(capacity)
+);
+
+/// Sleepers on zfchar_readq or zfchar_writeq are being woken
+TRACE_EVENT(zfchar_wakeup,
+   TP_PROTO(bool writers, unsigned int used),
+   TP_ARGS(writers, used),
+   TP_STRUCT__entry(
+      __field(bool, writers)
+      __field(unsigned int, used)
+   ),
+   TP_fast_assign(
+      __entry->writers = writers;
+      __entry->used = used;
+   ),
+   TP_printk("%s used=%u", __entry->writers ? "writers" : "readers", __entry->used)
+);
+
+#endif /* _ZFCHAR_TRACE_H */
+
+/// This header lives next to zfchar.c rather than in include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE zfchar_trace
+#include <trace/define_trace.h>
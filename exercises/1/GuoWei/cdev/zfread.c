@@ -5,12 +5,15 @@
 #include<string.h>
 #include<unistd.h>
 #include<stdbool.h>
+#include "zfchar.h"
 
-#define BUFFER_LENGTH 256               ///< The buffer length (crude but fine)
+#define BUFFER_LENGTH (65535 + 2)       ///< Room for the longest record and its length in record mode
 static unsigned char receive[BUFFER_LENGTH];     ///< The receive buffer from the LKM
 
-int main(){
+int main(int argc, char *argv[]){
    int ret, fd;
+   bool records = argc > 1 && strcmp(argv[1], "-r") == 0;   ///< zfchar was loaded with record=1
+   __u16 reclen;
    printf("Starting device test code example...\n");
    fd = open("/dev/zfchar", O_RDONLY);             // Open the device with read/write access
    if (fd < 0){
@@ -18,21 +21,32 @@ int main(){
       return errno;
    }
 
-   int ct = 0;
    int i = 0;
 
    while (true)
    {
-      printf("Reading from the device is ");
-      ret = read(fd, receive + i, 1);        // Read the response from the LKM
+      ret = read(fd, receive, BUFFER_LENGTH);  // Sleeps in the LKM until there is something to read
       if (ret < 0){
          perror("Failed to read the message from the device.");
          return errno;
       }
-      sleep(1);
 
-      printf("0x%02x\n", receive[i]);
-	   i++;
+      if (!records){
+         for (i = 0; i < ret; i++){
+            printf("Reading from the device is 0x%02x\n", receive[i]);
+         }
+         continue;
+      }
+
+      // one read returns a batch of whole messages, each behind its length
+      for (i = 0; i + ZFCHAR_RECORD_HDR <= ret; i += ZFCHAR_RECORD_HDR + reclen){
+         memcpy(&reclen, receive + i, ZFCHAR_RECORD_HDR);
+         printf("Message of %u bytes:", reclen);
+         for (int j = 0; j < reclen; j++){
+            printf(" 0x%02x", receive[i + ZFCHAR_RECORD_HDR + j]);
+         }
+         printf("\n");
+      }
    }
   
    printf("\nEnd of the program\n");
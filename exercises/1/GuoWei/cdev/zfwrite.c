@@ -14,11 +14,12 @@ typedef union
 
 int MAX_LOOP = 10;
 
-int main(){
+int main(int argc, char *argv[]){
    int ret, fd, ct;
    RAND_NU randx;
+   int interval = argc > 1 ? atoi(argv[1]) : 0;   ///< Seconds between writes, 0 writes as fast as zfread drains
    printf("Starting device write code example...\n");
-   fd = open("/dev/zfchar", O_RDWR | O_APPEND);             // Open the device with read/write access
+   fd = open("/dev/zfchar", O_WRONLY | O_APPEND);           // Write only, a writer is never a broadcast reader
    if (fd < 0){
       perror("Failed to open the device...");
       return errno;
@@ -33,7 +34,9 @@ int main(){
          perror("Failed to write the message to the device.");
          return errno;
       }
-      sleep(4);
+      if (interval > 0){
+         sleep(interval);                          // write() already blocks while the driver is full
+      }
    }
 
    return 0;
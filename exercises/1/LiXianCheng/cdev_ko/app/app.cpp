@@ -11,9 +11,58 @@
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <poll.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include "zfxor.h"
 
 #define MAX_LENGTH 4096
 #define LXC_IOCTL_GET_FIFO_LEN 0x80044c01 
+#define LXC_IOCTL_SET_QUEUE _IOW('L', 2, int)
+#define LXC_IOCTL_GET_QUEUE_COUNT _IOR('L', 3, unsigned int)
+#define LXC_IOCTL_RING_WAKE _IO('L', 4)
+#define LXC_IOCTL_SET_EVENTFD _IOW('L', 5, int)
+
+// 与驱动中struct lxc_wakeup一致
+struct lxc_wakeup
+{
+	unsigned int low_watermark;
+	unsigned int max_latency_us;
+};
+#define LXC_IOCTL_SET_WAKEUP _IOW('L', 6, struct lxc_wakeup)
+#define LXC_IOCTL_SET_READ_TIMEOUT _IOW('L', 7, unsigned int)
+
+// 与驱动中struct lxc_stats一致
+struct lxc_stats
+{
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long msgs_in;
+	unsigned long long msgs_out;
+	unsigned long long full_events;
+	unsigned long long empty_events;
+	unsigned long long short_writes;
+	unsigned long long wakeups;
+	unsigned long long sem_wait_ns;
+};
+#define LXC_IOCTL_GET_STATS _IOR('L', 8, struct lxc_stats)
+
+#define READ_TIMEOUT_MS 5000 // 阻塞读超时，超时后打印没有数据
+
+// 与驱动中struct lxc_mmap_ctrl一致，映射的第一页
+struct lxc_mmap_ctrl
+{
+	unsigned int head;
+	unsigned int data_size;
+	unsigned int reserved1[14];
+	unsigned int tail;
+	unsigned int writer_waiting;
+	unsigned int reserved2[14];
+};
 
 //sudo apt-get install uuid-dev
 std::string create_uuid()
@@ -40,9 +89,9 @@ int run_writer(void)
 	}
 	
 	printf("write some times\n");
+	// 驱动FIFO满时write会阻塞，不需要再sleep限速
 	for (int i = 0; i < 100; ++ i)
 	{
-		sleep(1);
 		std::string uuid = create_uuid();
 		printf("write data:%s\n", uuid.c_str());
 
@@ -53,7 +102,7 @@ int run_writer(void)
 		}
 		else
 		{
-			printf("write length %d success\n", uuid.length());
+			printf("write length %zd success\n", ret);
 		}
 	}
 
@@ -75,25 +124,30 @@ int run_reader(void)
 		printf("open success\n");
 	}
 
+	// read在没有数据时阻塞，不需要再sleep轮询
+	unsigned int timeout_ms = READ_TIMEOUT_MS;
+	if (-1 == ioctl(fd, LXC_IOCTL_SET_READ_TIMEOUT, &timeout_ms))
+	{
+		perror("set read timeout");
+	}
+
 	char buff[MAX_LENGTH + 1] = { 0 };
 
 	while (1)
 	{
-		sleep(1);
 		memset (buff, 0, sizeof(buff));
 		ssize_t ret = read(fd, buff, MAX_LENGTH-1);
-		if (-1 == ret)
+		if (-1 == ret && EAGAIN == errno)
+		{
+			printf("there is no data now\n");
+		}
+		else if (-1 == ret)
 		{
 			perror("read data");
 		}
 		else if (ret > 0)
 		{
-			char * cc = NULL;
-			for (size_t i = 0; i < ret; ++ i)
-			{
-				cc = buff + i;	
-				*cc ^= 0x55;
-			}
+			zf_xor(buff, buff, ret, ZF_XOR_KEY);
 
 			printf("read data:%s\n", buff);
 		}
@@ -108,6 +162,69 @@ int run_reader(void)
 	return 0;
 }
 
+// 驱动以record_mode=1加载时使用，每条消息前有__u16长度
+int run_record_reader(void)
+{
+	int fd = open("/dev/lxcdev0", O_RDWR);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+	else
+	{
+		printf("open success\n");
+	}
+
+	unsigned int timeout_ms = READ_TIMEOUT_MS;
+	if (-1 == ioctl(fd, LXC_IOCTL_SET_READ_TIMEOUT, &timeout_ms))
+	{
+		perror("set read timeout");
+	}
+
+	char buff[MAX_LENGTH] = { 0 };
+	char msg[MAX_LENGTH + 1] = { 0 };
+
+	while (1)
+	{
+		ssize_t ret = read(fd, buff, MAX_LENGTH);
+		if (-1 == ret && EAGAIN == errno)
+		{
+			printf("there is no data now\n");
+			continue;
+		}
+		else if (-1 == ret)
+		{
+			perror("read data");
+			continue;
+		}
+		else if (ret == 0)
+		{
+			printf("there is no data now\n");
+			continue;
+		}
+
+		// 一次read可能返回多条完整消息
+		ssize_t pos = 0;
+		while (pos + (ssize_t)sizeof(unsigned short) <= ret)
+		{
+			unsigned short msg_len = 0;
+			memcpy(&msg_len, buff + pos, sizeof(msg_len));
+			pos += sizeof(msg_len);
+
+			memset(msg, 0, sizeof(msg));
+			zf_xor(msg, buff + pos, msg_len, ZF_XOR_KEY);
+			pos += msg_len;
+
+			printf("read msg(%u):%s\n", msg_len, msg);
+		}
+	}
+
+	close(fd);
+	printf("reader exit now\n");
+	return 0;
+}
+
 int run_test(char *cmd)
 {
 	if (strcmp(cmd, "-guid") == 0)
@@ -148,6 +265,329 @@ int run_test(char *cmd)
 	return 0;
 }
 
+// 吞吐测试：子进程poll+read读走，父进程按chunk字节写入total_mb MB，统计MB/s
+// 驱动需以默认字节流模式加载，测试期间不要运行其他读进程
+int run_bench(size_t total_mb, size_t chunk)
+{
+	size_t total = total_mb << 20;
+	std::vector<char> buff(chunk, 'a');
+
+	pid_t pid = fork();
+	if (-1 == pid)
+	{
+		perror("fork");
+		return 0;
+	}
+
+	int fd = open("/dev/lxcdev0", O_RDWR);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+
+	if (0 == pid)
+	{
+		// 读进程
+		size_t read_total = 0;
+		pollfd fds[1];
+		while (read_total < total)
+		{
+			fds[0].fd = fd;
+			fds[0].events = POLLIN;
+			if (-1 == poll(fds, 1, -1))
+			{
+				perror("poll");
+				break;
+			}
+
+			ssize_t ret = read(fd, buff.data(), chunk);
+			if (-1 == ret)
+			{
+				perror("read data");
+				break;
+			}
+			read_total += ret;
+		}
+		close(fd);
+		exit(0);
+	}
+
+	struct timespec begin = { 0 };
+	struct timespec end = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	size_t write_total = 0;
+	while (write_total < total)
+	{
+		ssize_t ret = write(fd, buff.data(), std::min(chunk, total - write_total));
+		if (-1 == ret)
+		{
+			perror("write data");
+			break;
+		}
+		write_total += ret;
+	}
+	waitpid(pid, NULL, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	printf("chunk %zu bytes, %zu MB in %.3f s, %.1f MB/s\n",
+		chunk, write_total >> 20, seconds, (write_total >> 20) / seconds);
+
+	close(fd);
+	return 0;
+}
+
+// 打开设备并绑定到queue队列
+int open_queue(int queue)
+{
+	int fd = open("/dev/lxcdev0", O_RDWR);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return -1;
+	}
+
+	if (-1 == ioctl(fd, LXC_IOCTL_SET_QUEUE, &queue))
+	{
+		perror("set queue");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// 多队列吞吐测试：procs个写进程各写total_mb MB，第i个写进程绑定队列i%队列数，
+// 每个队列一个读进程，统计总吞吐。驱动以queue_count=N加载，对比不同N的结果
+int run_queue_bench(unsigned int procs, size_t total_mb)
+{
+	size_t total = total_mb << 20;
+	size_t chunk = 4096;
+	unsigned int queue_count = 1;
+	std::vector<pid_t> pids;
+
+	int fd = open("/dev/lxcdev0", O_RDWR);
+	if (-1 == fd || -1 == ioctl(fd, LXC_IOCTL_GET_QUEUE_COUNT, &queue_count))
+	{
+		perror("get queue count");
+		return 0;
+	}
+	close(fd);
+
+	struct timespec begin = { 0 };
+	struct timespec end = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	// 读进程，每个队列的数据量是写入该队列的写进程数乘以total
+	for (unsigned int q = 0; q < queue_count; ++q)
+	{
+		size_t expect = total * (procs / queue_count + (q < procs % queue_count ? 1 : 0));
+		pid_t pid = fork();
+		if (0 == pid)
+		{
+			std::vector<char> buff(chunk);
+			size_t read_total = 0;
+			int rfd = open_queue(q);
+			pollfd fds[1];
+			while (-1 != rfd && read_total < expect)
+			{
+				fds[0].fd = rfd;
+				fds[0].events = POLLIN;
+				if (-1 == poll(fds, 1, -1))
+				{
+					perror("poll");
+					break;
+				}
+
+				ssize_t ret = read(rfd, buff.data(), chunk);
+				if (-1 == ret)
+				{
+					perror("read data");
+					break;
+				}
+				read_total += ret;
+			}
+			exit(0);
+		}
+		pids.push_back(pid);
+	}
+
+	// 写进程
+	for (unsigned int i = 0; i < procs; ++i)
+	{
+		pid_t pid = fork();
+		if (0 == pid)
+		{
+			std::vector<char> buff(chunk, 'a');
+			size_t write_total = 0;
+			int wfd = open_queue(i % queue_count);
+			while (-1 != wfd && write_total < total)
+			{
+				ssize_t ret = write(wfd, buff.data(), std::min(chunk, total - write_total));
+				if (-1 == ret)
+				{
+					perror("write data");
+					break;
+				}
+				write_total += ret;
+			}
+			exit(0);
+		}
+		pids.push_back(pid);
+	}
+
+	for (size_t i = 0; i < pids.size(); ++i)
+	{
+		waitpid(pids[i], NULL, 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	printf("%u writers, %u queues, %zu MB in %.3f s, %.1f MB/s\n",
+		procs, queue_count, procs * total_mb, seconds, procs * total_mb / seconds);
+	return 0;
+}
+
+// mmap环的读进程（驱动以mmap_pages=N加载）：有数据时直接从映射中取，不做系统调用，
+// 环空时才poll；写进程因环满等待时才调用一次LXC_IOCTL_RING_WAKE
+// total为0时一直读；print时解密并打印
+int consume_mmap(int fd, size_t total, bool print)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	// 先只映射控制页，得到数据区大小
+	void *addr = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == addr)
+	{
+		perror("mmap ctrl");
+		return -1;
+	}
+	size_t size = ((lxc_mmap_ctrl *)addr)->data_size;
+	munmap(addr, page_size);
+
+	addr = mmap(NULL, page_size + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == addr)
+	{
+		perror("mmap ring");
+		return -1;
+	}
+	lxc_mmap_ctrl *ctrl = (lxc_mmap_ctrl *)addr;
+	unsigned char *data = (unsigned char *)addr + page_size;
+	std::vector<char> buff(size + 1);
+
+	unsigned int tail = ctrl->tail;
+	size_t got = 0;
+	while (0 == total || got < total)
+	{
+		unsigned int head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+		if (head == tail)
+		{
+			pollfd fds[1];
+			fds[0].fd = fd;
+			fds[0].events = POLLIN;
+			if (-1 == poll(fds, 1, -1))
+			{
+				perror("poll");
+				break;
+			}
+			continue;
+		}
+
+		while (tail != head)
+		{
+			size_t off = tail & (size - 1);
+			size_t len = std::min((size_t)(head - tail), size - off);
+			if (print)
+			{
+				zf_xor(buff.data(), data + off, len, ZF_XOR_KEY);
+				printf("read data:%.*s\n", (int)len, buff.data());
+			}
+			tail += len;
+			got += len;
+		}
+
+		// 先更新tail再看writer_waiting，与驱动中先写head再读tail对应
+		__atomic_store_n(&ctrl->tail, tail, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ctrl->writer_waiting, __ATOMIC_RELAXED))
+		{
+			__atomic_store_n(&ctrl->writer_waiting, 0, __ATOMIC_RELAXED);
+			ioctl(fd, LXC_IOCTL_RING_WAKE);
+		}
+	}
+
+	munmap(addr, page_size + size);
+	return 0;
+}
+
+int run_mmap_reader(void)
+{
+	int fd = open("/dev/lxcdev0", O_RDWR);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+
+	consume_mmap(fd, 0, true);
+	close(fd);
+	return 0;
+}
+
+// mmap环吞吐测试，与-bench的read/poll路径对比：子进程通过mmap读走，父进程按chunk写入
+int run_mmap_bench(size_t total_mb, size_t chunk)
+{
+	size_t total = total_mb << 20;
+	std::vector<char> buff(chunk, 'a');
+
+	pid_t pid = fork();
+	if (-1 == pid)
+	{
+		perror("fork");
+		return 0;
+	}
+
+	int fd = open("/dev/lxcdev0", O_RDWR);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+
+	if (0 == pid)
+	{
+		consume_mmap(fd, total, false);
+		close(fd);
+		exit(0);
+	}
+
+	struct timespec begin = { 0 };
+	struct timespec end = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	size_t write_total = 0;
+	while (write_total < total)
+	{
+		ssize_t ret = write(fd, buff.data(), std::min(chunk, total - write_total));
+		if (-1 == ret)
+		{
+			perror("write data");
+			break;
+		}
+		write_total += ret;
+	}
+	waitpid(pid, NULL, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	printf("mmap ring, chunk %zu bytes, %zu MB in %.3f s, %.1f MB/s\n",
+		chunk, write_total >> 20, seconds, (write_total >> 20) / seconds);
+
+	close(fd);
+	return 0;
+}
+
 void read_from_fd (int fd, char *buff, size_t buff_len)
 {
 	memset (buff, 0, buff_len);
@@ -158,12 +598,7 @@ void read_from_fd (int fd, char *buff, size_t buff_len)
 	}
 	else if (ret > 0)
 	{
-		char * cc = NULL;
-		for (size_t i = 0; i < ret; ++ i)
-		{
-			cc = buff + i;	
-			*cc ^= 0x55;
-		}
+		zf_xor(buff, buff, ret, ZF_XOR_KEY);
 
 		printf("read data:%s\n", buff);
 	}
@@ -173,6 +608,141 @@ void read_from_fd (int fd, char *buff, size_t buff_len)
 	}
 }
 
+// 非阻塞读到EAGAIN为止，驱动只在FIFO由空变为非空时通知，读不空会等不到下一次通知
+void drain_fd(int fd, char *buff, size_t buff_len)
+{
+	while (1)
+	{
+		memset(buff, 0, buff_len);
+		ssize_t ret = read(fd, buff, buff_len - 1);
+		if (-1 == ret)
+		{
+			if (EAGAIN != errno)
+			{
+				perror("read data");
+			}
+			break;
+		}
+		else if (0 == ret)
+		{
+			break;
+		}
+
+		zf_xor(buff, buff, ret, ZF_XOR_KEY);
+		printf("read data:%s\n", buff);
+	}
+}
+
+// epoll边沿触发读
+int run_epoll_reader(void)
+{
+	int fd = open("/dev/lxcdev0", O_RDWR | O_NONBLOCK);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+
+	int epfd = epoll_create1(0);
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = fd;
+	if (-1 == epfd || -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		perror("epoll");
+		close(fd);
+		return 0;
+	}
+
+	char buff[MAX_LENGTH + 1] = { 0 };
+	while (1)
+	{
+		struct epoll_event events[1];
+		if (epoll_wait(epfd, events, 1, -1) > 0)
+		{
+			drain_fd(fd, buff, sizeof(buff));
+		}
+	}
+
+	close(epfd);
+	close(fd);
+	return 0;
+}
+
+// eventfd读：注册eventfd，睡在eventfd上，被通知后读空设备
+int run_eventfd_reader(void)
+{
+	int fd = open("/dev/lxcdev0", O_RDWR | O_NONBLOCK);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+
+	int efd = eventfd(0, 0);
+	if (-1 == efd || -1 == ioctl(fd, LXC_IOCTL_SET_EVENTFD, &efd))
+	{
+		perror("eventfd");
+		close(fd);
+		return 0;
+	}
+
+	char buff[MAX_LENGTH + 1] = { 0 };
+	drain_fd(fd, buff, sizeof(buff)); // 注册之前写入的数据不会再通知
+	while (1)
+	{
+		uint64_t events = 0;
+		if (sizeof(events) == read(efd, &events, sizeof(events)))
+		{
+			drain_fd(fd, buff, sizeof(buff));
+		}
+	}
+
+	close(efd);
+	close(fd);
+	return 0;
+}
+
+// 设置唤醒阈值后poll读：攒够low_watermark字节，或者最早的数据等了max_latency_us才醒来
+int run_lowat_reader(unsigned int low_watermark, unsigned int max_latency_us)
+{
+	int fd = open("/dev/lxcdev0", O_RDWR | O_NONBLOCK);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+
+	struct lxc_wakeup wakeup = { low_watermark, max_latency_us };
+	if (-1 == ioctl(fd, LXC_IOCTL_SET_WAKEUP, &wakeup))
+	{
+		perror("set wakeup");
+		close(fd);
+		return 0;
+	}
+
+	char buff[MAX_LENGTH + 1] = { 0 };
+	while (1)
+	{
+		pollfd fds[1];
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		if (-1 == poll(fds, 1, -1))
+		{
+			perror("poll");
+			break;
+		}
+
+		unsigned long fifo_len = 0;
+		ioctl(fd, LXC_IOCTL_GET_FIFO_LEN, &fifo_len);
+		printf("wake up with %lu bytes queued\n", fifo_len);
+		drain_fd(fd, buff, sizeof(buff));
+	}
+
+	close(fd);
+	return 0;
+}
+
 int run_poll_reader(void)
 {
 	printf("start poll read\n");
@@ -277,6 +847,41 @@ int run_select_reader(void)
 	return 0;
 }
 
+// 每隔interval秒打印一次驱动统计，括号中是这段时间的增量
+int run_stats(unsigned int interval)
+{
+	int fd = open("/dev/lxcdev0", O_RDONLY);
+	if (-1 == fd)
+	{
+		perror("open error");
+		return 0;
+	}
+
+	lxc_stats last = { 0 };
+	lxc_stats now = { 0 };
+	while (1)
+	{
+		if (-1 == ioctl(fd, LXC_IOCTL_GET_STATS, &now))
+		{
+			perror("get stats");
+			break;
+		}
+
+		printf("bytes in %llu(+%llu) out %llu(+%llu), msgs in %llu(+%llu) out %llu(+%llu)\n",
+			now.bytes_in, now.bytes_in - last.bytes_in, now.bytes_out, now.bytes_out - last.bytes_out,
+			now.msgs_in, now.msgs_in - last.msgs_in, now.msgs_out, now.msgs_out - last.msgs_out);
+		printf("full %llu, empty %llu, short writes %llu, wakeups %llu, sem wait %llu us\n",
+			now.full_events, now.empty_events, now.short_writes, now.wakeups, now.sem_wait_ns / 1000);
+		fflush(stdout);
+
+		last = now;
+		sleep(interval);
+	}
+
+	close(fd);
+	return 0;
+}
+
 int main (int argc, char** argv)
 {
 	if (argc < 2)
@@ -293,6 +898,56 @@ int main (int argc, char** argv)
 	{
 		return run_reader(); // 普通读
 	}
+	else if (strcmp(argv[1], "-bench") == 0)
+	{
+		// app -bench [MB] [chunk]，默认256MB，每次4096字节
+		size_t total_mb = (argc > 2) ? strtoul(argv[2], NULL, 0) : 256;
+		size_t chunk = (argc > 3) ? strtoul(argv[3], NULL, 0) : 4096;
+		return run_bench(total_mb, (0 == chunk) ? 4096 : chunk); // 吞吐测试
+	}
+	else if (strcmp(argv[1], "-qbench") == 0)
+	{
+		// app -qbench [writers] [MB]，默认16个写进程，每个64MB
+		unsigned int procs = (argc > 2) ? strtoul(argv[2], NULL, 0) : 16;
+		size_t total_mb = (argc > 3) ? strtoul(argv[3], NULL, 0) : 64;
+		return run_queue_bench((0 == procs) ? 16 : procs, total_mb); // 多队列吞吐测试
+	}
+	else if (strcmp(argv[1], "-epr") == 0)
+	{
+		return run_epoll_reader(); // epoll边沿触发读
+	}
+	else if (strcmp(argv[1], "-er") == 0)
+	{
+		return run_eventfd_reader(); // eventfd通知读
+	}
+	else if (strcmp(argv[1], "-lr") == 0)
+	{
+		// app -lr [low_watermark] [max_latency_us]，默认1024字节、10ms
+		unsigned int low_watermark = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1024;
+		unsigned int max_latency_us = (argc > 3) ? strtoul(argv[3], NULL, 0) : 10000;
+		return run_lowat_reader(low_watermark, max_latency_us); // 按阈值批量读
+	}
+	else if (strcmp(argv[1], "-mr") == 0)
+	{
+		return run_mmap_reader(); // mmap环读
+	}
+	else if (strcmp(argv[1], "-mbench") == 0)
+	{
+		// app -mbench [MB] [chunk]，参数同-bench
+		size_t total_mb = (argc > 2) ? strtoul(argv[2], NULL, 0) : 256;
+		size_t chunk = (argc > 3) ? strtoul(argv[3], NULL, 0) : 4096;
+		return run_mmap_bench(total_mb, (0 == chunk) ? 4096 : chunk); // mmap环吞吐测试
+	}
+	else if (strcmp(argv[1], "-rr") == 0)
+	{
+		return run_record_reader(); // 按消息读
+	}
+	else if (strcmp(argv[1], "-stat") == 0)
+	{
+		// app -stat [interval]，默认每秒一次
+		unsigned int interval = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1;
+		return run_stats((0 == interval) ? 1 : interval); // 打印统计
+	}
 	else if (strcmp(argv[1], "-pr") == 0)
 	{
 		return run_poll_reader(); // poll 读
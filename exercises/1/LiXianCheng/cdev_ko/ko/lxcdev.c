@@ -11,27 +11,195 @@
 #include <linux/wait.h> // wake_up
 #include <linux/sched.h> // wake_up 中TASK_NORMAL
 #include <linux/file.h> // fget
+#include <linux/uio.h> // iov_iter
+#include <linux/jump_label.h> // static key
+#include <linux/vmalloc.h> // vmalloc_user
+#include <linux/mm.h> // remap_vmalloc_range
+#include <linux/log2.h> // roundup_pow_of_two
+#include <linux/eventfd.h> // eventfd_signal
+#include <linux/spinlock.h> // event_lock
+#include <linux/hrtimer.h> // 最大延迟定时器
+#include <linux/percpu.h> // 每CPU统计
+#include "zfxor.h" // zf_xor
+
+#define CREATE_TRACE_POINTS
+#include "lxcdev_trace.h" // enqueue/dequeue/full/empty/wakeup tracepoints
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("lxc");
 MODULE_DESCRIPTION("this is a first char device driver");
 
-#define BUFF_LEN 4096 //FIFO 以及临时缓冲区大小
+#define BUFF_LEN 4096 //FIFO 大小
+
+// 消息模式：每次write是一条消息，FIFO中存成__u16长度+内容，read按整条消息返回
+#define LXC_REC_HDR sizeof(__u16)
+#define LXC_REC_MAX 0xffff
 
 // ioctl相关 
 #define LXC_IOC_MAGIC 'L' // 魔术字
 #define LXC_IOCTL_GET_FIFO_LEN _IOR(LXC_IOC_MAGIC,1, unsigned long)
+#define LXC_IOCTL_SET_QUEUE _IOW(LXC_IOC_MAGIC,2, int) // 绑定队列，LXC_QUEUE_ANY取消绑定
+#define LXC_IOCTL_GET_QUEUE_COUNT _IOR(LXC_IOC_MAGIC,3, unsigned int)
+#define LXC_IOCTL_RING_WAKE _IO(LXC_IOC_MAGIC,4) // mmap环：读进程看到writer_waiting后唤醒写进程
+#define LXC_IOCTL_SET_EVENTFD _IOW(LXC_IOC_MAGIC,5, int) // 注册eventfd，-1取消注册
 
-// 自定义数据结构，存储设备信息等
-struct dev_data
+// 读进程的唤醒阈值，类似SO_RCVLOWAT，每个队列分别判断，mmap环模式下不使用
+struct lxc_wakeup
+{
+	__u32 low_watermark; // 队列中至少有这么多字节才可读，0和1都表示有数据就可读
+	__u32 max_latency_us; // 不足low_watermark时，最早的数据等待超过这个时间也可读，0表示不限
+};
+#define LXC_IOCTL_SET_WAKEUP _IOW(LXC_IOC_MAGIC,6, struct lxc_wakeup)
+#define LXC_IOCTL_SET_READ_TIMEOUT _IOW(LXC_IOC_MAGIC,7, unsigned int) // 阻塞读超时毫秒数，0表示一直等
+
+// 统计计数，全部是__u64，设备创建以来累计
+// 每个CPU各一份，读写路径只加本CPU的计数，ioctl/sysfs读取时再求和，不加锁
+// mmap环模式下数据在用户态取走，没有bytes_out/msgs_out/empty_events
+struct lxc_stats
+{
+	__u64 bytes_in; // write写入的字节数
+	__u64 bytes_out; // read返回的字节数，消息模式下含长度前缀
+	__u64 msgs_in; // 写入数据的write次数，消息模式下即消息数
+	__u64 msgs_out; // 消息模式下为读出的消息数，否则为读出数据的出队次数
+	__u64 full_events; // 写入时FIFO满
+	__u64 empty_events; // 读取时FIFO空
+	__u64 short_writes; // 只写入了一部分的write
+	__u64 wakeups; // 唤醒读进程、写进程的次数
+	__u64 sem_wait_ns; // 等待dev_sem的时间
+};
+#define LXC_IOCTL_GET_STATS _IOR(LXC_IOC_MAGIC,8, struct lxc_stats)
+
+#define LXC_QUEUE_ANY (-1) // 未绑定：写入当前CPU的队列，读取所有队列
+#define LXC_QUEUE_MAX 64
+
+// 一个队列，各队列有自己的FIFO、信号量和等待队列，互不竞争
+struct lxc_queue
 {
-	unsigned char dev_buff[BUFF_LEN]; // 存储临时加密的数据
-	struct cdev dev_cdev; // 设备信息
 	struct kfifo dev_fifo; // 存储加密后数据 
 	struct semaphore dev_sem; // 同步信号量
 	wait_queue_head_t read_wait_queue; // 读进程等待队列
+	wait_queue_head_t write_wait_queue; // 写进程等待队列，FIFO满时在此睡眠
+	u64 first_ns; // FIFO由空变为非空的时间，当作最早数据的入队时间
+	unsigned int wake_min; // 读这个队列的文件中最小的low_watermark
+	unsigned int wake_max; // 最大的low_watermark，FIFO长度跨过[wake_min, wake_max]时唤醒读进程
+} ____cacheline_aligned_in_smp;
+
+// mmap环的控制页，位于映射的第一页，数据页紧随其后，类似perf_event_mmap_page
+// head由内核写、tail由用户写，各占一个cache行
+struct lxc_mmap_ctrl
+{
+	__u32 head; // 内核写入的位置，只增不减，用时对data_size取模
+	__u32 data_size; // 数据区大小，2的幂
+	__u32 reserved1[14];
+	__u32 tail; // 用户读到的位置，用户取走数据后更新
+	__u32 writer_waiting; // 内核置1表示有写进程在等空间，用户清0并调用LXC_IOCTL_RING_WAKE
+	__u32 reserved2[14];
+};
+
+// mmap环，mmap_pages不为0时write写入这里，读进程通过mmap直接读取，不用read
+struct lxc_ring
+{
+	struct lxc_mmap_ctrl *ctrl; // 控制页，后面紧跟数据页，vmalloc_user分配
+	unsigned char *data; // 数据页
+	unsigned int size; // 数据区大小
+	unsigned int head; // 内核自己记录的写入位置，不依赖用户可写的控制页
+	struct semaphore dev_sem; // 写进程之间互斥
+	wait_queue_head_t read_wait_queue; // 环由空变为非空时唤醒
+	wait_queue_head_t write_wait_queue; // 环满时写进程在此睡眠
+};
+
+// 自定义数据结构，存储设备信息等
+struct dev_data
+{
+	struct cdev dev_cdev; // 设备信息
+	struct lxc_queue *queues; // queue_count个队列
+	struct lxc_ring ring; // mmap环
+	struct fasync_struct *async_queue; // fasync注册的进程，有数据时发SIGIO
+	wait_queue_head_t read_wait_queue; // 未绑定队列的阻塞读进程在此等待任意队列有数据
+	spinlock_t event_lock; // 保护event_files和reader_files
+	struct list_head event_files; // 注册了eventfd的文件
+	struct list_head reader_files; // 读过、poll读过或设置过阈值的文件，用来计算各队列的wake_min/wake_max
 	dev_t dev_id; // 设备id	
-} __attribute__((packed));
+};
+
+// 每个打开文件的信息，存在private_data中
+struct lxc_file
+{
+	int queue; // 绑定的队列，LXC_QUEUE_ANY表示未绑定
+	unsigned int next_queue; // 未绑定时下一次读取从哪个队列开始
+	struct eventfd_ctx *event_ctx; // LXC_IOCTL_SET_EVENTFD注册的eventfd
+	struct list_head event_node; // 挂在event_files上
+	struct list_head reader_node; // 挂在reader_files上
+	unsigned int low_watermark; // 唤醒阈值，见struct lxc_wakeup
+	u64 max_latency_ns;
+	struct hrtimer latency_timer; // 数据不足low_watermark时，到最大延迟唤醒读进程
+	long read_timeout; // 阻塞读超时，jiffies
+};
+
+// 调试日志开关，关闭时读写路径上只剩一条nop指令
+// 开启：echo 1 > /sys/module/lxcdev/parameters/debug
+DEFINE_STATIC_KEY_FALSE(lxc_debug_key);
+
+#define LXC_DBG(fmt, ...) \
+	do { \
+		if (static_branch_unlikely(&lxc_debug_key)) \
+			printk(KERN_DEBUG "lxc:" fmt, ##__VA_ARGS__); \
+	} while (0)
+
+// 每CPU统计，this_cpu_add不需要关抢占，也不会和其他CPU竞争缓存行
+DEFINE_PER_CPU(struct lxc_stats, lxc_cpu_stats);
+
+#define LXC_STAT_ADD(field, n) this_cpu_add(lxc_cpu_stats.field, (n))
+#define LXC_STAT_INC(field) this_cpu_inc(lxc_cpu_stats.field)
+
+int lxc_set_debug(const char *val, const struct kernel_param *kp)
+{
+	bool enable = false;
+	int result = kstrtobool(val, &enable);
+
+	if (0 != result)
+	{
+		return result;
+	}
+
+	if (enable)
+	{
+		static_branch_enable(&lxc_debug_key);
+	}
+	else
+	{
+		static_branch_disable(&lxc_debug_key);
+	}
+	return 0;
+}
+
+int lxc_get_debug(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%c\n", static_key_enabled(&lxc_debug_key) ? 'Y' : 'N');
+}
+
+const struct kernel_param_ops lxc_debug_ops = 
+{
+	.set = lxc_set_debug,
+	.get = lxc_get_debug,
+};
+module_param_cb(debug, &lxc_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "print per-call debug messages from the I/O paths");
+
+// 消息模式开关，加载时指定：insmod lxcdev.ko record_mode=1
+bool record_mode = false;
+module_param(record_mode, bool, S_IRUGO);
+MODULE_PARM_DESC(record_mode, "keep message boundaries, read() returns length-prefixed messages");
+
+// 队列个数，加载时指定：insmod lxcdev.ko queue_count=8，0表示每个CPU一个队列
+unsigned int queue_count = 1;
+module_param(queue_count, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_count, "number of FIFOs, 0 for one per possible CPU");
+
+// mmap环的数据页数，向上取2的幂，加载时指定：insmod lxcdev.ko mmap_pages=16，0表示不使用
+unsigned int mmap_pages = 0;
+module_param(mmap_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(mmap_pages, "data pages of the mmap ring, 0 keeps the read() path");
 
 // 全局设备信息
 struct dev_data * global_data = NULL;
@@ -49,16 +217,64 @@ asmlinkage long lxc_sys_open(const char __user *filename, int flag, umode_t mode
 // 获取当前FIFO中存储数据长度
 long get_fifo_len(struct file *filp, unsigned long arg);
 
+// 绑定队列
+long set_queue(struct file *filp, unsigned long arg);
+
+// 注册eventfd
+long set_eventfd(struct file *filp, unsigned long arg);
+
+// 设置唤醒阈值
+long set_wakeup(struct file *filp, unsigned long arg);
+
+// 设置阻塞读超时
+long set_read_timeout(struct file *filp, unsigned long arg);
+
+// 获取统计
+long get_stats(struct file *filp, unsigned long arg);
+
+// mmap环：唤醒等空间的写进程，没有启用mmap环时等待队列没有初始化
+long lxc_ring_wake(void)
+{
+	if (NULL == global_data->ring.ctrl)
+	{
+		return -ENODEV;
+	}
+
+	wake_up(&global_data->ring.write_wait_queue);
+	return 0;
+}
+
 // ioctl实现
 long lxc_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	long result = 0;
-	printk(KERN_DEBUG"lxc:lxc_unlocked_ioctl, cmd = %u\n", cmd);
+	LXC_DBG("lxc_unlocked_ioctl, cmd = %u\n", cmd);
 	switch (cmd)
 	{
 		case LXC_IOCTL_GET_FIFO_LEN:	
 			result = get_fifo_len(filp, arg);
 			break;
+		case LXC_IOCTL_SET_QUEUE:
+			result = set_queue(filp, arg);
+			break;
+		case LXC_IOCTL_GET_QUEUE_COUNT:
+			result = put_user(queue_count, (unsigned int __user *)arg);
+			break;
+		case LXC_IOCTL_RING_WAKE:
+			result = lxc_ring_wake();
+			break;
+		case LXC_IOCTL_SET_EVENTFD:
+			result = set_eventfd(filp, arg);
+			break;
+		case LXC_IOCTL_SET_WAKEUP:
+			result = set_wakeup(filp, arg);
+			break;
+		case LXC_IOCTL_SET_READ_TIMEOUT:
+			result = set_read_timeout(filp, arg);
+			break;
+		case LXC_IOCTL_GET_STATS:
+			result = get_stats(filp, arg);
+			break;
 		default:
 			result = -ENOTTY;
 			break;
@@ -71,12 +287,33 @@ long lxc_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 long lxc_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	long result = 0;
-	printk(KERN_DEBUG"lxc:lxc_compat_ioctl, cmd = %u\n", cmd);
+	LXC_DBG("lxc_compat_ioctl, cmd = %u\n", cmd);
 	switch (cmd)
 	{
 		case LXC_IOCTL_GET_FIFO_LEN:	
 			result = get_fifo_len(filp, arg);
 			break;
+		case LXC_IOCTL_SET_QUEUE:
+			result = set_queue(filp, arg);
+			break;
+		case LXC_IOCTL_GET_QUEUE_COUNT:
+			result = put_user(queue_count, (unsigned int __user *)arg);
+			break;
+		case LXC_IOCTL_RING_WAKE:
+			result = lxc_ring_wake();
+			break;
+		case LXC_IOCTL_SET_EVENTFD:
+			result = set_eventfd(filp, arg);
+			break;
+		case LXC_IOCTL_SET_WAKEUP:
+			result = set_wakeup(filp, arg);
+			break;
+		case LXC_IOCTL_SET_READ_TIMEOUT:
+			result = set_read_timeout(filp, arg);
+			break;
+		case LXC_IOCTL_GET_STATS:
+			result = get_stats(filp, arg);
+			break;
 		default:
 			result = -ENOTTY;
 			break;
@@ -84,217 +321,1142 @@ long lxc_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return result;
 }
 
+// 唤醒文件要读的队列上的读进程
+void lxc_wake_file_queues(struct lxc_file *lxc_filp)
+{
+	int bound = READ_ONCE(lxc_filp->queue);
+	unsigned int i = 0;
+
+	for (i = 0; i < queue_count; ++i)
+	{
+		if (LXC_QUEUE_ANY == bound || (int)i == bound)
+		{
+			wake_up(&global_data->queues[i].read_wait_queue);
+		}
+	}
+
+	if (LXC_QUEUE_ANY == bound)
+	{
+		wake_up(&global_data->read_wait_queue);
+	}
+}
+
+// 最大延迟到了，唤醒读进程重新检查
+enum hrtimer_restart lxc_latency_timer(struct hrtimer *timer)
+{
+	lxc_wake_file_queues(container_of(timer, struct lxc_file, latency_timer));
+	return HRTIMER_NORESTART;
+}
+
+// 重新计算各队列的wake_min/wake_max，在open/release和修改绑定、阈值时调用
+void lxc_update_wake_marks(void)
+{
+	struct lxc_file *lxc_filp = NULL;
+	struct lxc_queue *queue = NULL;
+	unsigned int i = 0;
+	int bound = 0;
+
+	unsigned int wake_min = 0;
+	unsigned int wake_max = 0;
+
+	spin_lock(&global_data->event_lock);
+	for (i = 0; i < queue_count; ++i)
+	{
+		queue = &global_data->queues[i];
+		wake_min = UINT_MAX;
+		wake_max = 1;
+		list_for_each_entry(lxc_filp, &global_data->reader_files, reader_node)
+		{
+			bound = READ_ONCE(lxc_filp->queue);
+			if (LXC_QUEUE_ANY == bound || (int)i == bound)
+			{
+				wake_min = min(wake_min, READ_ONCE(lxc_filp->low_watermark));
+				wake_max = max(wake_max, READ_ONCE(lxc_filp->low_watermark));
+			}
+		}
+		// 没有读进程时按有数据就唤醒
+		wake_min = min(wake_min, wake_max);
+
+		// lxc_notify_readers不加锁读取，每个值只能看到计算完的结果，不会看到中间值。
+		// 两个值分开写，可能读到新wake_min和旧wake_max，这没有关系：前后都在的读进程，
+		// 阈值在新旧两个区间的交集里，也就在任意新旧组合的区间里，跨过它的写入一定唤醒；
+		// 新加入或改了阈值的读进程在更新之后会自己重新检查，不依赖这次唤醒
+		WRITE_ONCE(queue->wake_min, wake_min);
+		WRITE_ONCE(queue->wake_max, wake_max);
+	}
+	spin_unlock(&global_data->event_lock);
+}
+
+// 文件在队列上是否可读：数据达到low_watermark，或者最早的数据已经等待超过最大延迟
+// 都不满足时启动定时器，到最大延迟时唤醒；调用者在检查前已经挂到等待队列上
+bool lxc_queue_readable(struct lxc_file *lxc_filp, struct lxc_queue *queue)
+{
+	unsigned int fifo_len = kfifo_len(&queue->dev_fifo);
+	u64 deadline = 0;
+
+	if (0 == fifo_len)
+	{
+		return false;
+	}
+
+	// 有写进程在等空间时FIFO不会再涨（消息模式下可能停在low_watermark以下），
+	// 不管阈值，先把已有的数据交出去，否则读写双方互相等待
+	if (waitqueue_active(&queue->write_wait_queue))
+	{
+		return true;
+	}
+
+	if (fifo_len >= lxc_filp->low_watermark || 0 == lxc_filp->max_latency_ns)
+	{
+		return fifo_len >= lxc_filp->low_watermark;
+	}
+
+	deadline = READ_ONCE(queue->first_ns) + lxc_filp->max_latency_ns;
+	if (ktime_get_ns() >= deadline)
+	{
+		return true;
+	}
+
+	// 已经启动了更早的定时器时不改
+	if (!hrtimer_active(&lxc_filp->latency_timer) ||
+		ktime_to_ns(hrtimer_get_expires(&lxc_filp->latency_timer)) > deadline)
+	{
+		hrtimer_start(&lxc_filp->latency_timer, ns_to_ktime(deadline), HRTIMER_MODE_ABS);
+	}
+	return false;
+}
+
+// 文件要读的队列中是否有一个可读，见lxc_queue_readable
+bool lxc_file_readable(struct lxc_file *lxc_filp)
+{
+	int bound = READ_ONCE(lxc_filp->queue);
+	unsigned int i = 0;
+
+	for (i = 0; i < queue_count; ++i)
+	{
+		if ((LXC_QUEUE_ANY == bound || (int)i == bound) &&
+			lxc_queue_readable(lxc_filp, &global_data->queues[i]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// 第一次read、poll读或设置阈值时才加入reader_files，参与计算唤醒阈值
+// app等以O_RDWR打开只用来写的文件不会把wake_min拉低到1，返回是否新加入
+bool lxc_add_reader(struct lxc_file *lxc_filp)
+{
+	bool added = false;
+
+	if (!list_empty(&lxc_filp->reader_node))
+	{
+		return false;
+	}
+
+	spin_lock(&global_data->event_lock);
+	added = list_empty(&lxc_filp->reader_node);
+	if (added)
+	{
+		list_add_tail(&lxc_filp->reader_node, &global_data->reader_files);
+	}
+	spin_unlock(&global_data->event_lock);
+	return added;
+}
+
 // open实现
 int lxc_open(struct inode *inodp, struct file *filp)
 {
-	printk(KERN_DEBUG"lxc:lxc_open\n");
+	struct lxc_file *lxc_filp = NULL;
+
+	LXC_DBG("lxc_open\n");
+
+	lxc_filp = kzalloc(sizeof(struct lxc_file), GFP_KERNEL);
+	if (NULL == lxc_filp)
+	{
+		return -ENOMEM;
+	}
+
+	// 默认不绑定：写入当前CPU的队列，读取所有队列
+	lxc_filp->queue = LXC_QUEUE_ANY;
+	INIT_LIST_HEAD(&lxc_filp->event_node);
+	INIT_LIST_HEAD(&lxc_filp->reader_node);
+	lxc_filp->low_watermark = 1;
+	lxc_filp->read_timeout = MAX_SCHEDULE_TIMEOUT;
+	hrtimer_init(&lxc_filp->latency_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	lxc_filp->latency_timer.function = lxc_latency_timer;
+	filp->private_data = lxc_filp;
+
+	// io_uring/aio可以带IOCB_NOWAIT直接调用read_iter/write_iter
+	filp->f_mode |= FMODE_NOWAIT;
+	return 0;
+}
+
+// 写进程使用的队列：绑定的队列，或者当前CPU对应的队列
+struct lxc_queue *lxc_write_queue(struct file *filp)
+{
+	struct lxc_file *lxc_filp = filp->private_data;
+	int queue = READ_ONCE(lxc_filp->queue);
+
+	if (LXC_QUEUE_ANY == queue)
+	{
+		queue = raw_smp_processor_id() % queue_count;
+	}
+	return &global_data->queues[queue];
+}
+
+// 队列queue（mmap环为LXC_QUEUE_ANY）的数据从old_len增加到new_len后通知读进程
+// 等待队列：长度跨过某个读进程的low_watermark时唤醒，阈值都是1时就是由空变为非空
+// SIGIO、eventfd：只在由空变为非空时通知
+// 读进程要一直读到EAGAIN，EPOLLET下也不会漏掉数据
+void lxc_notify_readers(wait_queue_head_t *wq, int queue, unsigned int old_len, unsigned int new_len)
+{
+	struct lxc_file *lxc_filp = NULL;
+	unsigned int wake_min = 1;
+	unsigned int wake_max = 1;
+	int bound = 0;
+
+	if (LXC_QUEUE_ANY != queue)
+	{
+		wake_min = READ_ONCE(global_data->queues[queue].wake_min);
+		wake_max = READ_ONCE(global_data->queues[queue].wake_max);
+	}
+
+	// wq_has_sleeper带有内存屏障，和poll_wait之后的检查配对
+	if (old_len < wake_max && new_len >= wake_min)
+	{
+		if (wq_has_sleeper(wq))
+		{
+			trace_lxcdev_wakeup(false, new_len);
+			LXC_STAT_INC(wakeups);
+			wake_up(wq);
+		}
+
+		// 未绑定队列的阻塞读进程
+		if (LXC_QUEUE_ANY != queue && wq_has_sleeper(&global_data->read_wait_queue))
+		{
+			LXC_STAT_INC(wakeups);
+			wake_up(&global_data->read_wait_queue);
+		}
+	}
+
+	if (0 != old_len)
+	{
+		return;
+	}
+
+	kill_fasync(&global_data->async_queue, SIGIO, POLL_IN);
+
+	if (list_empty(&global_data->event_files))
+	{
+		return;
+	}
+
+	spin_lock(&global_data->event_lock);
+	list_for_each_entry(lxc_filp, &global_data->event_files, event_node)
+	{
+		bound = READ_ONCE(lxc_filp->queue);
+		if (LXC_QUEUE_ANY == queue || LXC_QUEUE_ANY == bound || bound == queue)
+		{
+			eventfd_signal(lxc_filp->event_ctx, 1);
+		}
+	}
+	spin_unlock(&global_data->event_lock);
+}
+
+// 获取信号量，IOCB_NOWAIT时不睡眠，拿不到返回-EAGAIN
+// 先trylock，只有真的要等时才读时钟，统计等待时间
+int lxc_lock_iocb(struct semaphore *sem, struct kiocb *iocb)
+{
+	u64 start_ns = 0;
+	int result = 0;
+
+	if (0 == down_trylock(sem))
+	{
+		return 0;
+	}
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
+	{
+		return -EAGAIN;
+	}
+
+	start_ns = ktime_get_ns();
+	result = down_interruptible(sem);
+	LXC_STAT_ADD(sem_wait_ns, ktime_get_ns() - start_ns);
+	if (0 != result)
+	{
+		LXC_DBG("wait sem error\n");
+		return -ERESTARTSYS;
+	}
+
 	return 0;
 }
 
-// read实现
-ssize_t lxc_read(struct file *filp, char __user *buff, size_t count, loff_t *offp)
+// 从用户空间直接拷入FIFO存储区in+skip处并原地加密，类似kfifo_from_user，不用中转缓冲区
+// 不移动in，由调用者确认全部拷贝成功后提交；调用者持有dev_sem并保证空间足够
+size_t lxc_fifo_fill(struct lxc_queue *queue, struct iov_iter *from, unsigned int skip, size_t len)
+{
+	struct __kfifo *fifo = &queue->dev_fifo.kfifo;
+	unsigned int off = (fifo->in + skip) & fifo->mask;
+	size_t first = min_t(size_t, len, fifo->mask + 1 - off);
+	size_t copied = copy_from_iter(fifo->data + off, first, from);
+
+	// 存储区尾部放不下时回绕到开头
+	if (copied == first && len > first)
+	{
+		copied += copy_from_iter(fifo->data, len - first, from);
+	}
+
+	// 按实际拷入的长度分两段加密
+	zf_xor(fifo->data + off, fifo->data + off, min(copied, first), ZF_XOR_KEY);
+	if (copied > first)
+	{
+		zf_xor(fifo->data, fifo->data, copied - first, ZF_XOR_KEY);
+	}
+	return copied;
+}
+
+// 提交lxc_fifo_fill写入的数据
+void lxc_fifo_commit(struct lxc_queue *queue, size_t len)
+{
+	// 数据先于in可见
+	smp_wmb();
+	queue->dev_fifo.kfifo.in += len;
+}
+
+// 从FIFO存储区直接拷给用户并移动out，类似kfifo_to_user，调用者持有dev_sem
+size_t lxc_fifo_drain(struct lxc_queue *queue, struct iov_iter *to, size_t len)
+{
+	struct __kfifo *fifo = &queue->dev_fifo.kfifo;
+	unsigned int off = fifo->out & fifo->mask;
+	size_t first = min_t(size_t, len, fifo->mask + 1 - off);
+	size_t copied = copy_to_iter(fifo->data + off, first, to);
+
+	if (copied == first && len > first)
+	{
+		copied += copy_to_iter(fifo->data, len - first, to);
+	}
+
+	// 拷贝完成后再让出空间
+	smp_mb();
+	fifo->out += copied;
+	return copied;
+}
+
+// 消息模式下的出队：长度和内容原样拷给用户，尽可能多地取整条消息，调用者持有dev_sem
+ssize_t lxc_out_records(struct lxc_queue *queue, struct iov_iter *to, size_t count)
+{
+	ssize_t result = 0;
+	size_t copy_len = 0;
+	__u16 rec_len = 0;
+
+	while (!kfifo_is_empty(&queue->dev_fifo))
+	{
+		kfifo_out_peek(&queue->dev_fifo, &rec_len, LXC_REC_HDR);
+		if (result + LXC_REC_HDR + rec_len > count)
+		{
+			break;
+		}
+
+		copy_len = lxc_fifo_drain(queue, to, LXC_REC_HDR + rec_len);
+		if (copy_len != LXC_REC_HDR + rec_len)
+		{
+			// 丢弃这条消息剩下的部分，保证下一次从消息边界开始
+			queue->dev_fifo.kfifo.out += LXC_REC_HDR + rec_len - copy_len;
+			LXC_DBG("copy_to_iter error\n");
+			return (0 == result) ? -EFAULT : result;
+		}
+		result += copy_len;
+		LXC_STAT_INC(msgs_out);
+	}
+
+	// 第一条消息就放不下
+	if (0 == result)
+	{
+		LXC_DBG("buffer too small for a %u byte message\n", rec_len);
+		return -EMSGSIZE;
+	}
+	return result;
+}
+
+// 从一个队列读取，FIFO为空时返回0
+ssize_t lxc_read_queue(struct lxc_queue *queue, struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t result = 0;
+	size_t count = iov_iter_count(to);
 	size_t read_len = 0;
 	unsigned int fifo_len = 0;
 
-	printk(KERN_DEBUG"lxc:lxc_read\n");
+	result = lxc_lock_iocb(&queue->dev_sem, iocb);
+	if (0 != result)
+	{
+		return result;
+	}
 
-	if (0 == count)
+	do
+	{
+		if (kfifo_is_empty(&queue->dev_fifo))
+		{
+			trace_lxcdev_empty(kfifo_size(&queue->dev_fifo));
+			LXC_STAT_INC(empty_events);
+			LXC_DBG("fifo is empty now\n");
+			result = 0;			
+		}
+		else if (record_mode)
+		{
+			result = lxc_out_records(queue, to, count);
+			trace_lxcdev_dequeue(result, kfifo_len(&queue->dev_fifo));
+		}
+		else
+		{
+			fifo_len = kfifo_len(&queue->dev_fifo);
+			LXC_DBG("fifo now len = %d\n", fifo_len);
+
+			read_len = (fifo_len >= count) ? count : fifo_len;
+
+			// 直接从FIFO存储区拷给用户，填满所有iovec
+			result = lxc_fifo_drain(queue, to, read_len);
+			if (0 == result)
+			{
+				LXC_DBG("copy_to_iter error\n");
+				result = -EFAULT;
+			}
+			else
+			{
+				LXC_STAT_INC(msgs_out);
+			}
+			trace_lxcdev_dequeue(result, kfifo_len(&queue->dev_fifo));
+			LXC_DBG("success out len %zd\n", result);
+		}
+	}
+	while (false);
+
+	up(&queue->dev_sem);
+
+	if (result > 0)
+	{
+		LXC_STAT_ADD(bytes_out, result);
+	}
+
+	// 腾出了空间，有写进程在等时才唤醒
+	if (result > 0 && wq_has_sleeper(&queue->write_wait_queue))
+	{
+		trace_lxcdev_wakeup(true, kfifo_len(&queue->dev_fifo));
+		LXC_STAT_INC(wakeups);
+		wake_up(&queue->write_wait_queue);
+	}
+
+	return result;
+}
+
+// 读取一次文件要读的队列，没有数据时返回0
+// 绑定了队列时只读该队列，否则从上次之后的队列开始依次读取所有队列，直到填满用户缓冲区
+ssize_t lxc_read_queues(struct lxc_file *lxc_filp, struct kiocb *iocb, struct iov_iter *to)
+{
+	int queue = READ_ONCE(lxc_filp->queue);
+	unsigned int first = 0;
+	unsigned int count = 0;
+	unsigned int i = 0;
+	ssize_t result = 0;
+	ssize_t ret = 0;
+
+	// 绑定了队列时只读这一个
+	if (LXC_QUEUE_ANY != queue)
+	{
+		first = queue;
+		count = 1;
+	}
+	else
+	{
+		// 每次换一个起始队列，避免后面的队列一直读不到
+		first = lxc_filp->next_queue;
+		lxc_filp->next_queue = (first + 1) % queue_count;
+		count = queue_count;
+	}
+
+	for (i = 0; i < count && iov_iter_count(to) > 0; ++i)
+	{
+		ret = lxc_read_queue(&global_data->queues[(first + i) % queue_count], iocb, to);
+		if (ret < 0)
+		{
+			// 已经读到数据时先返回数据
+			if (0 == result)
+			{
+				result = ret;
+			}
+			break;
+		}
+		result += ret;
+	}
+
+	return result;
+}
+
+// read实现，read/readv/aio/io_uring都走这里
+// 没有数据时阻塞，直到有可读的数据（满足唤醒阈值）或者超过read_timeout
+// O_NONBLOCK/IOCB_NOWAIT时返回EAGAIN，EPOLLET的读进程据此判断已经读空
+ssize_t lxc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct lxc_file *lxc_filp = iocb->ki_filp->private_data;
+	bool nonblock = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+	long timeout = READ_ONCE(lxc_filp->read_timeout);
+	wait_queue_head_t *wq = NULL;
+	ssize_t result = 0;
+	long ret = 0;
+
+	LXC_DBG("lxc_read_iter\n");
+
+	if (0 == iov_iter_count(to))
 	{
-		printk(KERN_DEBUG"lxc:do nothing when count is 0\n");
+		LXC_DBG("do nothing when count is 0\n");
 		return 0;
 	}
 
-	// 检查用户空间缓冲区和存储大小
-	if (1 != access_ok(VERITY_WRITE, buff, count))
-	{
-		printk(KERN_ERR"lxc:too less buff size to get %d len, or user ptr invalid\n", count);
-		return -ENOMEM;
-	}
+	// mmap环模式下数据只能通过mmap读取
+	if (NULL != global_data->ring.ctrl)
+	{
+		return -EINVAL;
+	}
+
+	if (lxc_add_reader(lxc_filp))
+	{
+		lxc_update_wake_marks();
+	}
+
+	while (1)
+	{
+		// 阻塞读要等数据达到唤醒阈值，非阻塞读有多少读多少
+		if (nonblock || lxc_file_readable(lxc_filp))
+		{
+			result = lxc_read_queues(lxc_filp, iocb, to);
+			if (0 != result)
+			{
+				break;
+			}
+		}
+
+		if (nonblock)
+		{
+			result = -EAGAIN;
+			break;
+		}
+
+		// 绑定了队列时睡在该队列上，否则睡在设备的read_wait_queue上，任意队列有数据都会被唤醒
+		wq = (LXC_QUEUE_ANY == READ_ONCE(lxc_filp->queue)) ? &global_data->read_wait_queue :
+			&global_data->queues[READ_ONCE(lxc_filp->queue)].read_wait_queue;
+		ret = wait_event_interruptible_timeout(*wq, lxc_file_readable(lxc_filp), timeout);
+		if (ret < 0)
+		{
+			result = -ERESTARTSYS;
+			break;
+		}
+		if (0 == ret)
+		{
+			// 超时，和SO_RCVTIMEO一样返回EAGAIN
+			LXC_DBG("read timeout\n");
+			result = -EAGAIN;
+			break;
+		}
+		timeout = ret;
+	}
+
+	return result;
+}
+
+// 统计一次write
+void lxc_count_write(size_t count, size_t writen_len)
+{
+	if (0 == writen_len)
+	{
+		return;
+	}
+
+	LXC_STAT_ADD(bytes_in, writen_len);
+	LXC_STAT_INC(msgs_in);
+	if (writen_len < count)
+	{
+		LXC_STAT_INC(short_writes);
+	}
+}
+
+// mmap环的剩余空间，用户把tail写坏时当作已满
+unsigned int lxc_ring_room(struct lxc_ring *ring)
+{
+	unsigned int used = READ_ONCE(ring->head) - smp_load_acquire(&ring->ctrl->tail);
+
+	return (used > ring->size) ? 0 : ring->size - used;
+}
+
+// 从用户空间直接拷入mmap环pos处并原地加密，返回实际拷入的长度
+size_t lxc_ring_fill(struct lxc_ring *ring, struct iov_iter *from, unsigned int pos, size_t len)
+{
+	unsigned int off = pos & (ring->size - 1);
+	size_t first = min_t(size_t, len, ring->size - off);
+	size_t copied = copy_from_iter(ring->data + off, first, from);
+
+	if (copied == first && len > first)
+	{
+		copied += copy_from_iter(ring->data, len - first, from);
+	}
+
+	zf_xor(ring->data + off, ring->data + off, min(copied, first), ZF_XOR_KEY);
+	if (copied > first)
+	{
+		zf_xor(ring->data, ring->data, copied - first, ZF_XOR_KEY);
+	}
+	return copied;
+}
+
+// mmap环模式的write，读进程在用户态直接取数据，只有环由空变为非空时才唤醒读进程
+ssize_t lxc_ring_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct lxc_ring *ring = &global_data->ring;
+	size_t count = iov_iter_count(from);
+	size_t need_len = record_mode ? LXC_REC_HDR + count : 1;
+	size_t writen_len = 0;
+	size_t round_len = 0;
+	size_t copy_len = 0;
+	unsigned int old_head = 0;
+	unsigned int pos = 0;
+	unsigned int i = 0;
+	bool was_empty = false;
+	__u16 rec_len = (__u16)count;
+	ssize_t result = 0;
+
+	if (record_mode && (count > LXC_REC_MAX || need_len > ring->size))
+	{
+		LXC_DBG("message too long, count = %zu\n", count);
+		return -EMSGSIZE;
+	}
+
+	while (writen_len < count)
+	{
+		result = lxc_lock_iocb(&ring->dev_sem, iocb);
+		if (0 != result)
+		{
+			break;
+		}
+
+		old_head = ring->head;
+		pos = old_head;
+		round_len = lxc_ring_room(ring);
+		if (record_mode)
+		{
+			round_len = (round_len >= need_len) ? count : 0;
+			if (round_len > 0)
+			{
+				// 长度可能跨过数据区末尾，逐字节写入
+				for (i = 0; i < LXC_REC_HDR; ++i)
+				{
+					ring->data[(pos + i) & (ring->size - 1)] = ((unsigned char *)&rec_len)[i];
+				}
+				pos += LXC_REC_HDR;
+			}
+		}
+		else
+		{
+			round_len = min_t(size_t, round_len, count - writen_len);
+		}
+
+		if (round_len > 0)
+		{
+			copy_len = lxc_ring_fill(ring, from, pos, round_len);
+			if (copy_len != round_len)
+			{
+				LXC_DBG("copy_from_iter error\n");
+				result = -EFAULT;
+				// 消息模式下拷了一半的消息不发布，字节流模式下只发布拷入的部分
+				round_len = record_mode ? 0 : copy_len;
+			}
+		}
+
+		was_empty = false;
+		if (round_len > 0)
+		{
+			ring->head = pos + round_len;
+			smp_store_release(&ring->ctrl->head, ring->head);
+
+			// 读进程先写tail再读head，这里先写head再读tail，两边都有全屏障，
+			// 读到tail等于旧的head时读进程可能已经或即将睡眠，需要唤醒
+			smp_mb();
+			was_empty = (READ_ONCE(ring->ctrl->tail) == old_head);
+			writen_len += round_len;
+			trace_lxcdev_enqueue(round_len, ring->head - READ_ONCE(ring->ctrl->tail));
+		}
 
-	if (0 != down_interruptible(&global_data->dev_sem))
-	{
-		printk(KERN_ERR"lxc:wait sem error\n");
-		return -ERESTARTSYS;
-	}
+		up(&ring->dev_sem);
 
-	do
-	{
-		if (kfifo_is_empty(&global_data->dev_fifo))
+		if (was_empty)
 		{
-			printk(KERN_ERR"lxc:fifo is empty now\n");
-			result = 0;			
+			lxc_notify_readers(&ring->read_wait_queue, LXC_QUEUE_ANY, 0, round_len);
 		}
-		else
-		{
-			fifo_len = kfifo_len(&global_data->dev_fifo);
-			printk(KERN_DEBUG"lxc:fifo now len = %d\n", fifo_len);
 
-			read_len = (fifo_len >= count) ? count : fifo_len;
+		if (0 != result || writen_len == count)
+		{
+			break;
+		}
 
-			memset(global_data->dev_buff, 0, BUFF_LEN);
-			result = kfifo_out(&global_data->dev_fifo, global_data->dev_buff, read_len);
+		// 环已满，告诉读进程取走数据后唤醒我们
+		trace_lxcdev_full(ring->size);
+		LXC_STAT_INC(full_events);
+		if ((iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK))
+		{
+			result = -EAGAIN;
+			break;
+		}
 
-			if (0 != copy_to_user(buff, global_data->dev_buff, result))
-			{
-				printk(KERN_ERR"lxc,copy_to_user error\n");
-				result = -EFAULT;
-				break;
-			}
-			printk(KERN_DEBUG"lxc,success out len %d\n", result);
+		WRITE_ONCE(ring->ctrl->writer_waiting, 1);
+		smp_mb();
+		if (0 != wait_event_interruptible(ring->write_wait_queue, lxc_ring_room(ring) >= need_len))
+		{
+			result = -ERESTARTSYS;
+			break;
 		}
 	}
-	while (false);
 
-	up(&global_data->dev_sem);
+	lxc_count_write(count, writen_len);
+	return (writen_len > 0) ? writen_len : result;
+}
 
-	return result;
+// 写进程的等待条件，在挂到write_wait_queue之后求值
+// 空间不够时唤醒按阈值等待的读进程，让它们看到有写进程在等（见lxc_queue_readable）
+bool lxc_writer_can_go(struct lxc_queue *queue, size_t need_len)
+{
+	if (kfifo_avail(&queue->dev_fifo) >= need_len)
+	{
+		return true;
+	}
+
+	if (wq_has_sleeper(&queue->read_wait_queue))
+	{
+		LXC_STAT_INC(wakeups);
+		wake_up(&queue->read_wait_queue);
+	}
+	if (wq_has_sleeper(&global_data->read_wait_queue))
+	{
+		LXC_STAT_INC(wakeups);
+		wake_up(&global_data->read_wait_queue);
+	}
+	return false;
 }
 
-// write实现
-ssize_t lxc_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp)
+// write实现，一次writev的所有记录直接拷入FIFO、原地加密、入队
+// FIFO满时释放信号量睡眠在write_wait_queue上，直到全部写入；O_NONBLOCK/IOCB_NOWAIT返回-EAGAIN
+// 消息模式下整条消息一次入队，空间不够整条消息时等待
+ssize_t lxc_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+	struct lxc_queue *queue = lxc_write_queue(iocb->ki_filp);
+	size_t count = iov_iter_count(from);
+	size_t need_len = record_mode ? LXC_REC_HDR + count : 1;
 	size_t remain_len = 0;
 	size_t writen_len = 0;
-	size_t index = 0;
-	char * cc = NULL;
+	size_t round_len = 0;
+	unsigned int skip = record_mode ? LXC_REC_HDR : 0;
+	unsigned int old_len = 0;
+	unsigned int new_len = 0;
+	__u16 rec_len = (__u16)count;
 	ssize_t result = 0;
-	unsigned int fifo_len = 0;
 
-	printk(KERN_DEBUG"lxc:lxc_write\n");
+	LXC_DBG("lxc_write_iter\n");
 		
 	if (0 == count)
 	{
-		printk(KERN_DEBUG"lxc:do nothing when count is 0\n");
+		LXC_DBG("do nothing when count is 0\n");
 		return 0;
 	}
 
-	if (1 != access_ok(VERITY_READ, buff, count))
+	if (NULL != global_data->ring.ctrl)
 	{
-		printk(KERN_ERR"lxc:invalid user ptr\n");
-		return -EFAULT;
+		return lxc_ring_write(iocb, from);
 	}
 
-	if (0 != down_interruptible(&global_data->dev_sem))
+	// 消息太长，永远放不进FIFO
+	if (record_mode && (count > LXC_REC_MAX || need_len > kfifo_size(&queue->dev_fifo)))
 	{
-		printk(KERN_ERR"lxc:wait sem error\n");
-		return -ERESTARTSYS;
+		LXC_DBG("message too long, count = %zu\n", count);
+		return -EMSGSIZE;
 	}
 
-	do
+	while (writen_len < count)
 	{
-		// 根据输入当前的长度，计算剩余可以写入的长度
-		if (kfifo_is_full(&global_data->dev_fifo))
+		result = lxc_lock_iocb(&queue->dev_sem, iocb);
+		if (0 != result)
 		{
-			// 唤醒读进程
-			wake_up(&global_data->read_wait_queue);
-
-			printk(KERN_DEBUG"lxc:fifo is full\n");
-			result = 0;
 			break;
 		}
 
-		fifo_len = kfifo_len(&global_data->dev_fifo);
+		// 根据当前剩余空间，计算本轮可以写入的长度
+		old_len = kfifo_len(&queue->dev_fifo);
+		remain_len = kfifo_avail(&queue->dev_fifo);
+		if (record_mode)
+		{
+			// 放不下整条消息时本轮不写
+			remain_len = (remain_len >= need_len) ? count : 0;
+		}
+		else
+		{
+			remain_len = (count - writen_len >= remain_len) ? remain_len : count - writen_len;
+		}
 
-		if (fifo_len < BUFF_LEN)
+		// 直接拷入FIFO存储区并原地加密，消息模式下内容放在长度后面
+		round_len = 0;
+		if (remain_len > 0)
 		{
-			remain_len = BUFF_LEN - fifo_len;
-			writen_len = (count >= remain_len) ? remain_len : count;
-				
-			// copy data from user address
-			memset(global_data->dev_buff, 0, BUFF_LEN);
-			if (0 != copy_from_user(global_data->dev_buff, buff, writen_len))
+			round_len = lxc_fifo_fill(queue, from, skip, remain_len);
+			if (round_len != remain_len)
 			{
-				printk(KERN_ERR"lxc:copy_from_user error\n");
+				LXC_DBG("copy_from_iter error\n");
 				result = -EFAULT;
-			}
-			else
-			{
-				// 对输入的数据，逐个进行加密
-				for (index = 0; index < writen_len; ++ index)
+				// 消息模式下丢弃拷了一半的消息，保证FIFO中都是完整消息
+				if (record_mode)
 				{
-					cc = global_data->dev_buff + index;
-					*cc ^= 0x55;
+					round_len = 0;
 				}
+			}
+		}
+
+		// 内容拷贝成功后再写入长度，一起提交
+		if (record_mode && round_len > 0)
+		{
+			kfifo_in(&queue->dev_fifo, &rec_len, LXC_REC_HDR);
+		}
+		lxc_fifo_commit(queue, round_len);
+		writen_len += round_len;
+		new_len = kfifo_len(&queue->dev_fifo);
+		if (0 == old_len && new_len > 0)
+		{
+			WRITE_ONCE(queue->first_ns, ktime_get_ns());
+		}
+		trace_lxcdev_enqueue(round_len, new_len);
 
-				result = kfifo_in(&global_data->dev_fifo, global_data->dev_buff, writen_len);
-				printk(KERN_DEBUG"lxc:push fifo len = %d\n", result);
+		up(&queue->dev_sem);
+		LXC_DBG("push fifo len = %zu\n", writen_len);
 
-				// 唤醒读进程
-				wake_up(&global_data->read_wait_queue);
-			}
+		// 按各读进程的唤醒阈值通知，FIFO中原来就有足够的数据时读进程不会在睡眠
+		if (round_len > 0)
+		{
+			lxc_notify_readers(&queue->read_wait_queue, queue - global_data->queues,
+				old_len, new_len);
 		}
-		else
-		{	
-			wake_up(&global_data->read_wait_queue);
-			printk(KERN_DEBUG"lxc:fifo is full\n");
-			result = 0;	
+
+		if (0 != result || writen_len == count)
+		{
+			break;
+		}
+
+		// FIFO已满，等待读进程取走数据
+		trace_lxcdev_full(kfifo_size(&queue->dev_fifo));
+		LXC_STAT_INC(full_events);
+		if ((iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK))
+		{
+			LXC_DBG("fifo is full\n");
+			result = -EAGAIN;
+			break;
+		}
+
+		if (0 != wait_event_interruptible(queue->write_wait_queue,
+			lxc_writer_can_go(queue, need_len)))
+		{
+			result = -ERESTARTSYS;
+			break;
 		}
 	}
-	while (false);
-	
-	up(&global_data->dev_sem);
 
-	return result;
+	// 已经写入部分数据时返回写入长度
+	lxc_count_write(count, writen_len);
+	return (writen_len > 0) ? writen_len : result;
+}
+
+// fasync实现，F_SETFL设置FASYNC后，FIFO由空变为非空时收到SIGIO
+int lxc_fasync(int fd, struct file *filp, int on)
+{
+	return fasync_helper(fd, filp, on, &global_data->async_queue);
 }
 
 // release实现
 int lxc_release(struct inode *inodp, struct file *filp)
 {
-	printk(KERN_DEBUG"lxc:lxc_release\n");
+	struct lxc_file *lxc_filp = filp->private_data;
+
+	LXC_DBG("lxc_release\n");
+
+	lxc_fasync(-1, filp, 0);
+	hrtimer_cancel(&lxc_filp->latency_timer);
+	if (!list_empty(&lxc_filp->reader_node))
+	{
+		spin_lock(&global_data->event_lock);
+		list_del(&lxc_filp->reader_node);
+		spin_unlock(&global_data->event_lock);
+		lxc_update_wake_marks();
+	}
+	if (NULL != lxc_filp->event_ctx)
+	{
+		spin_lock(&global_data->event_lock);
+		list_del(&lxc_filp->event_node);
+		spin_unlock(&global_data->event_lock);
+		eventfd_ctx_put(lxc_filp->event_ctx);
+	}
+	kfree(lxc_filp);
 	return 0;
 }
 
 // lseek实现
 loff_t lxc_llseek(struct file *filp, loff_t off, int whence)
 {
-	printk(KERN_DEBUG"lxc:lxc_llseek\n");
+	LXC_DBG("lxc_llseek\n");
 	return 0;
 }
 
 // poll实现
+// 可读：绑定的队列，或者任意一个队列中有数据；可写：本进程写入的队列未满
 unsigned int lxc_poll(struct file *filp, poll_table *wait)
 {
+	struct lxc_file *lxc_filp = filp->private_data;
+	struct lxc_queue *write_queue = lxc_write_queue(filp);
+	struct lxc_queue *queue = NULL;
+	int bound = READ_ONCE(lxc_filp->queue);
 	unsigned int mask = 0;
-	unsigned int fifo_len = 0;
-
-	printk(KERN_DEBUG"lxc:lxc_poll\n");
+	unsigned int i = 0;
 
-	// 添加到读等待队列中，并非立即休眠，而只是添加到队列中。
-	poll_wait(filp, &global_data->read_wait_queue, wait);
+	LXC_DBG("lxc_poll\n");
 
-	if (0 != down_interruptible(&global_data->dev_sem))
+	// mmap环：有未读数据可读，有空间可写，不需要加锁
+	if (NULL != global_data->ring.ctrl)
 	{
-		printk(KERN_ERR"lxc:wait sem error\n");
+		poll_wait(filp, &global_data->ring.read_wait_queue, wait);
+		poll_wait(filp, &global_data->ring.write_wait_queue, wait);
+		smp_mb();
+		if (READ_ONCE(global_data->ring.head) != READ_ONCE(global_data->ring.ctrl->tail))
+		{
+			mask |= POLLIN | POLLRDNORM;
+		}
+		if (lxc_ring_room(&global_data->ring) > 0)
+		{
+			mask |= POLLOUT | POLLWRNORM;
+		}
 		return mask;
 	}
 
-	fifo_len = kfifo_len(&global_data->dev_fifo);
-	if (fifo_len > 0)
+	// 只等POLLOUT的写进程不算读进程
+	if ((poll_requested_events(wait) & (POLLIN | POLLRDNORM)) && lxc_add_reader(lxc_filp))
 	{
-		mask |= POLLIN | POLLRDNORM;
+		lxc_update_wake_marks();
+	}
+
+	// 添加到读、写等待队列中，并非立即休眠，而只是添加到队列中。
+	for (i = 0; i < queue_count; ++i)
+	{
+		if (LXC_QUEUE_ANY == bound || (int)i == bound)
+		{
+			poll_wait(filp, &global_data->queues[i].read_wait_queue, wait);
+		}
 	}
+	poll_wait(filp, &write_queue->write_wait_queue, wait);
+
+	// 先挂到等待队列再看FIFO，和写进程提交数据后的wq_has_sleeper配对
+	smp_mb();
 
-	up(&global_data->dev_sem);
+	// 只读in/out，不加锁
+	for (i = 0; i < queue_count; ++i)
+	{
+		queue = &global_data->queues[i];
+		if ((LXC_QUEUE_ANY == bound || (int)i == bound) && lxc_queue_readable(lxc_filp, queue))
+		{
+			mask |= POLLIN | POLLRDNORM;
+			break;
+		}
+	}
+	if (!kfifo_is_full(&write_queue->dev_fifo))
+	{
+		mask |= POLLOUT | POLLWRNORM;
+	}
 
 	return mask;
 }
 
+// mmap实现，映射mmap环的控制页和数据页，可以只映射前面一部分（比如先映射控制页读data_size）
+int lxc_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct lxc_ring *ring = &global_data->ring;
+
+	LXC_DBG("lxc_mmap\n");
+
+	if (NULL == ring->ctrl)
+	{
+		return -ENODEV;
+	}
+
+	if (0 != vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE + ring->size)
+	{
+		return -EINVAL;
+	}
+
+	return remap_vmalloc_range(vma, ring->ctrl, 0);
+}
+
 // 设备文件操作
 const struct file_operations lxc_file_operations = 
 {
 	.owner = THIS_MODULE,
 	.open = lxc_open,
-	.read = lxc_read,
-	.write = lxc_write,
+	.read_iter = lxc_read_iter,
+	.write_iter = lxc_write_iter,
 	.release = lxc_release,
 	.unlocked_ioctl = lxc_unlocked_ioctl,
 	.compat_ioctl = lxc_compat_ioctl,
 	.poll = lxc_poll,
+	.fasync = lxc_fasync,
+	.mmap = lxc_mmap,
 	.llseek = lxc_llseek,
 };
 
+// 释放前count个队列
+void free_queues(unsigned int count)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < count; ++i)
+	{
+		kfifo_free(&global_data->queues[i].dev_fifo);
+	}
+	kfree(global_data->queues);
+}
+
+// 按queue_count分配队列，初始化FIFO、信号量和读写等待队列
+int alloc_queues(void)
+{
+	struct lxc_queue *queue = NULL;
+	unsigned int i = 0;
+	int result = 0;
+
+	if (0 == queue_count)
+	{
+		queue_count = num_possible_cpus();
+	}
+	queue_count = min_t(unsigned int, queue_count, LXC_QUEUE_MAX);
+
+	global_data->queues = kcalloc(queue_count, sizeof(struct lxc_queue), GFP_KERNEL);
+	if (NULL == global_data->queues)
+	{
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < queue_count; ++i)
+	{
+		queue = &global_data->queues[i];
+
+		result = kfifo_alloc(&queue->dev_fifo, BUFF_LEN, GFP_KERNEL);
+		if (0 != result)
+		{
+			free_queues(i);
+			return -ENOMEM;
+		}
+
+		sema_init(&queue->dev_sem, 1);
+		init_waitqueue_head(&queue->read_wait_queue);
+		init_waitqueue_head(&queue->write_wait_queue);
+		queue->wake_min = 1;
+		queue->wake_max = 1;
+	}
+
+	return 0;
+}
+
+// 按mmap_pages分配mmap环，控制页和数据页连续，vmalloc_user已清零
+int alloc_ring(void)
+{
+	struct lxc_ring *ring = &global_data->ring;
+
+	ring->ctrl = NULL;
+	if (0 == mmap_pages)
+	{
+		return 0;
+	}
+
+	mmap_pages = roundup_pow_of_two(min_t(unsigned int, mmap_pages, 1024));
+	ring->size = mmap_pages * PAGE_SIZE;
+	ring->head = 0;
+	ring->ctrl = vmalloc_user(PAGE_SIZE + ring->size);
+	if (NULL == ring->ctrl)
+	{
+		return -ENOMEM;
+	}
+
+	ring->data = (unsigned char *)ring->ctrl + PAGE_SIZE;
+	ring->ctrl->data_size = ring->size;
+	sema_init(&ring->dev_sem, 1);
+	init_waitqueue_head(&ring->read_wait_queue);
+	init_waitqueue_head(&ring->write_wait_queue);
+	return 0;
+}
+
+// 各CPU的统计求和，只读计数，不影响读写路径
+void lxc_sum_stats(struct lxc_stats *sum)
+{
+	const __u64 *cpu_stats = NULL;
+	__u64 *total = (__u64 *)sum;
+	unsigned int cpu = 0;
+	unsigned int i = 0;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu)
+	{
+		// struct lxc_stats全是__u64，按数组逐项相加
+		cpu_stats = (const __u64 *)per_cpu_ptr(&lxc_cpu_stats, cpu);
+		for (i = 0; i < sizeof(*sum) / sizeof(__u64); ++i)
+		{
+			total[i] += READ_ONCE(cpu_stats[i]);
+		}
+	}
+}
+
+// sysfs：/sys/class/lxcdev_class/lxcdev0/stats/下每个计数一个文件
+#define LXC_STAT_ATTR(field) \
+	ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+	{ \
+		struct lxc_stats sum; \
+		lxc_sum_stats(&sum); \
+		return sprintf(buf, "%llu\n", (unsigned long long)sum.field); \
+	} \
+	static DEVICE_ATTR_RO(field)
+
+LXC_STAT_ATTR(bytes_in);
+LXC_STAT_ATTR(bytes_out);
+LXC_STAT_ATTR(msgs_in);
+LXC_STAT_ATTR(msgs_out);
+LXC_STAT_ATTR(full_events);
+LXC_STAT_ATTR(empty_events);
+LXC_STAT_ATTR(short_writes);
+LXC_STAT_ATTR(wakeups);
+LXC_STAT_ATTR(sem_wait_ns);
+
+struct attribute *lxc_stats_attrs[] =
+{
+	&dev_attr_bytes_in.attr,
+	&dev_attr_bytes_out.attr,
+	&dev_attr_msgs_in.attr,
+	&dev_attr_msgs_out.attr,
+	&dev_attr_full_events.attr,
+	&dev_attr_empty_events.attr,
+	&dev_attr_short_writes.attr,
+	&dev_attr_wakeups.attr,
+	&dev_attr_sem_wait_ns.attr,
+	NULL,
+};
+
+const struct attribute_group lxc_stats_group =
+{
+	.name = "stats",
+	.attrs = lxc_stats_attrs,
+};
+
+const struct attribute_group *lxc_dev_groups[] =
+{
+	&lxc_stats_group,
+	NULL,
+};
+
 static int __init dev_init(void)
 {
 	int result = 0;
@@ -311,23 +1473,28 @@ static int __init dev_init(void)
 			goto final_exit;
 		}
 
-		// 分配FIFO
-		result = kfifo_alloc(&global_data->dev_fifo, BUFF_LEN, GFP_KERNEL);
+		// 分配队列及各自的FIFO
+		result = alloc_queues();
 		if (0 != result)
 		{
-			printk(KERN_ERR"lxc:init, kfifo_init error:%d\n", result);
-			result = -ENOMEM;
+			printk(KERN_ERR"lxc:init, alloc_queues error:%d\n", result);
 			goto release_global; 
 		}
 
-		memset(global_data->dev_buff, 0, sizeof(BUFF_LEN));
-		global_data->dev_id = 0;
-
-		// 初始化信号量
-		sema_init(&global_data->dev_sem, 1);
+		// 分配mmap环
+		result = alloc_ring();
+		if (0 != result)
+		{
+			printk(KERN_ERR"lxc:init, alloc_ring error:%d\n", result);
+			goto release_fifo;
+		}
 
-		// 初始化读等待队列
+		global_data->dev_id = 0;
+		global_data->async_queue = NULL;
 		init_waitqueue_head(&global_data->read_wait_queue);
+		spin_lock_init(&global_data->event_lock);
+		INIT_LIST_HEAD(&global_data->event_files);
+		INIT_LIST_HEAD(&global_data->reader_files);
 
 		// 分配设备号
 		result = alloc_chrdev_region(&(global_data->dev_id), 0, 1, "lxcdev");	
@@ -358,10 +1525,10 @@ static int __init dev_init(void)
 			goto del_cdev;
 		}
 
-		// 创建一个设备，以便打开操作
-		dev_instance = device_create(lxcdev_class, NULL, global_data->dev_id, 
-			"lxcdev", "lxcdev%d", 0);
-		if (NULL == dev_instance)
+		// 创建一个设备，以便打开操作，同时创建统计的sysfs文件
+		dev_instance = device_create_with_groups(lxcdev_class, NULL, global_data->dev_id,
+			"lxcdev", lxc_dev_groups, "lxcdev%d", 0);
+		if (IS_ERR_OR_NULL(dev_instance))
 		{
 			printk(KERN_ERR"lxc:init device_create error\n");
 			result = -ENOMEM;
@@ -382,7 +1549,8 @@ unregister_cdev:
 	unregister_chrdev_region(global_data->dev_id, 1);	
 
 release_fifo:
-	kfifo_free(&global_data->dev_fifo);	
+	vfree(global_data->ring.ctrl);
+	free_queues(queue_count);
 
 release_global:
 	kfree(global_data);
@@ -488,7 +1656,8 @@ static void __exit lxcdev_uninit(void)
 	class_destroy(lxcdev_class);
 	cdev_del(&global_data->dev_cdev);
 	unregister_chrdev_region(global_data->dev_id, 1);
-	kfifo_free(&global_data->dev_fifo);
+	vfree(global_data->ring.ctrl);
+	free_queues(queue_count);
 	kfree(global_data);
 }
 
@@ -497,35 +1666,169 @@ module_exit(lxcdev_uninit);
 
 long get_fifo_len(struct file *filp, unsigned long arg)
 {
+	struct lxc_file *lxc_filp = filp->private_data;
+	struct lxc_queue *queue = NULL;
+	int bound = READ_ONCE(lxc_filp->queue);
+	unsigned int i = 0;
 	long result = 0;
-	unsigned int fifo_len = 0;
+	unsigned long fifo_len = 0;
 
-	printk(KERN_ALERT"lxc:user ptr = %p\n", (void *)arg);
+	LXC_DBG("user ptr = %p\n", (void *)arg);
 
 	if (1 != access_ok(VERIFY_WRITE, arg, sizeof(unsigned long)))
 	{
-		printk(KERN_ERR"lxc:invalid user ptr\n");
+		LXC_DBG("invalid user ptr\n");
 		return -EFAULT;
 	}
 
-	if (0 != down_interruptible(&global_data->dev_sem))
+	// 绑定了队列时只统计该队列，否则统计所有队列
+	for (i = 0; i < queue_count; ++i)
 	{
-		printk(KERN_ERR"lxc:wait sem error\n");
-		return -ERESTARTSYS;
+		if (LXC_QUEUE_ANY != bound && (int)i != bound)
+		{
+			continue;
+		}
+
+		queue = &global_data->queues[i];
+		if (0 != down_interruptible(&queue->dev_sem))
+		{
+			LXC_DBG("wait sem error\n");
+			return -ERESTARTSYS;
+		}
+
+		fifo_len += kfifo_len(&queue->dev_fifo);
+
+		up(&queue->dev_sem);
 	}
 
-	fifo_len = kfifo_len(&global_data->dev_fifo);
 	if (0 != copy_to_user((void __user *)arg, &fifo_len, sizeof(unsigned long)))
 	{
-		printk(KERN_ERR"lxc:copy_to_user error\n");
+		LXC_DBG("copy_to_user error\n");
 		result = -EFAULT;
 	}
 
-	up(&global_data->dev_sem);
-
 	return result;
 }
 
+long set_queue(struct file *filp, unsigned long arg)
+{
+	struct lxc_file *lxc_filp = filp->private_data;
+	int queue = 0;
+
+	if (0 != get_user(queue, (int __user *)arg))
+	{
+		return -EFAULT;
+	}
+
+	if (LXC_QUEUE_ANY != queue && (queue < 0 || queue >= (int)queue_count))
+	{
+		LXC_DBG("invalid queue %d\n", queue);
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(lxc_filp->queue, queue);
+	if (!list_empty(&lxc_filp->reader_node))
+	{
+		lxc_update_wake_marks();
+	}
+	return 0;
+}
+
+long get_stats(struct file *filp, unsigned long arg)
+{
+	struct lxc_stats sum;
+
+	lxc_sum_stats(&sum);
+	if (0 != copy_to_user((void __user *)arg, &sum, sizeof(sum)))
+	{
+		LXC_DBG("copy_to_user error\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+long set_read_timeout(struct file *filp, unsigned long arg)
+{
+	struct lxc_file *lxc_filp = filp->private_data;
+	unsigned int timeout_ms = 0;
+
+	if (0 != get_user(timeout_ms, (unsigned int __user *)arg))
+	{
+		return -EFAULT;
+	}
+
+	WRITE_ONCE(lxc_filp->read_timeout, (0 == timeout_ms) ? MAX_SCHEDULE_TIMEOUT :
+		(long)msecs_to_jiffies(timeout_ms));
+	return 0;
+}
+
+long set_wakeup(struct file *filp, unsigned long arg)
+{
+	struct lxc_file *lxc_filp = filp->private_data;
+	struct lxc_wakeup wakeup = { 0 };
+
+	if (0 != copy_from_user(&wakeup, (void __user *)arg, sizeof(wakeup)))
+	{
+		return -EFAULT;
+	}
+
+	// 超过FIFO大小的阈值永远达不到
+	WRITE_ONCE(lxc_filp->low_watermark, clamp_t(__u32, wakeup.low_watermark, 1, BUFF_LEN));
+	WRITE_ONCE(lxc_filp->max_latency_ns, (u64)wakeup.max_latency_us * NSEC_PER_USEC);
+	if (filp->f_mode & FMODE_READ)
+	{
+		lxc_add_reader(lxc_filp);
+		lxc_update_wake_marks();
+	}
+
+	// 阈值变了，让已经在等的读进程按新阈值重新检查
+	lxc_wake_file_queues(lxc_filp);
+	return 0;
+}
+
+long set_eventfd(struct file *filp, unsigned long arg)
+{
+	struct lxc_file *lxc_filp = filp->private_data;
+	struct eventfd_ctx *new_ctx = NULL;
+	struct eventfd_ctx *old_ctx = NULL;
+	int event_fd = 0;
+
+	if (0 != get_user(event_fd, (int __user *)arg))
+	{
+		return -EFAULT;
+	}
+
+	if (event_fd >= 0)
+	{
+		new_ctx = eventfd_ctx_fdget(event_fd);
+		if (IS_ERR(new_ctx))
+		{
+			return PTR_ERR(new_ctx);
+		}
+	}
+
+	// 替换已注册的eventfd，写进程在event_lock下遍历
+	spin_lock(&global_data->event_lock);
+	old_ctx = lxc_filp->event_ctx;
+	if (NULL != old_ctx)
+	{
+		list_del_init(&lxc_filp->event_node);
+	}
+	lxc_filp->event_ctx = new_ctx;
+	if (NULL != new_ctx)
+	{
+		list_add_tail(&lxc_filp->event_node, &global_data->event_files);
+	}
+	spin_unlock(&global_data->event_lock);
+
+	if (NULL != old_ctx)
+	{
+		eventfd_ctx_put(old_ctx);
+	}
+	return 0;
+}
+
 asmlinkage long lxc_sys_open(const char __user *filename, int flag, umode_t mode)
 {
 	long result = 0;
@@ -0,0 +1,81 @@
+// lxcdev的tracepoint定义，未开启时只有一个nop的开销
+// 开启：echo 1 > /sys/kernel/debug/tracing/events/lxcdev/enable
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lxcdev
+
+#if !defined(_LXCDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LXCDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// 入队/出队：本次长度，以及操作后FIFO中的数据长度
+DECLARE_EVENT_CLASS(lxcdev_io,
+	TP_PROTO(size_t len, unsigned int fifo_len),
+	TP_ARGS(len, fifo_len),
+	TP_STRUCT__entry(
+		__field(size_t, len)
+		__field(unsigned int, fifo_len)
+	),
+	TP_fast_assign(
+		__entry->len = len;
+		__entry->fifo_len = fifo_len;
+	),
+	TP_printk("len=%zu fifo_len=%u", __entry->len, __entry->fifo_len)
+);
+
+DEFINE_EVENT(lxcdev_io, lxcdev_enqueue,
+	TP_PROTO(size_t len, unsigned int fifo_len),
+	TP_ARGS(len, fifo_len)
+);
+
+DEFINE_EVENT(lxcdev_io, lxcdev_dequeue,
+	TP_PROTO(size_t len, unsigned int fifo_len),
+	TP_ARGS(len, fifo_len)
+);
+
+// FIFO满/空：写进程要等待，或读进程没有读到数据
+DECLARE_EVENT_CLASS(lxcdev_state,
+	TP_PROTO(unsigned int fifo_size),
+	TP_ARGS(fifo_size),
+	TP_STRUCT__entry(
+		__field(unsigned int, fifo_size)
+	),
+	TP_fast_assign(
+		__entry->fifo_size = fifo_size;
+	),
+	TP_printk("fifo_size=%u", __entry->fifo_size)
+);
+
+DEFINE_EVENT(lxcdev_state, lxcdev_full,
+	TP_PROTO(unsigned int fifo_size),
+	TP_ARGS(fifo_size)
+);
+
+DEFINE_EVENT(lxcdev_state, lxcdev_empty,
+	TP_PROTO(unsigned int fifo_size),
+	TP_ARGS(fifo_size)
+);
+
+// 唤醒读或写等待队列
+TRACE_EVENT(lxcdev_wakeup,
+	TP_PROTO(bool writers, unsigned int fifo_len),
+	TP_ARGS(writers, fifo_len),
+	TP_STRUCT__entry(
+		__field(bool, writers)
+		__field(unsigned int, fifo_len)
+	),
+	TP_fast_assign(
+		__entry->writers = writers;
+		__entry->fifo_len = fifo_len;
+	),
+	TP_printk("%s fifo_len=%u", __entry->writers ? "writers" : "readers", __entry->fifo_len)
+);
+
+#endif /* _LXCDEV_TRACE_H */
+
+// 头文件不在include/trace/events下，告诉define_trace.h去哪里找
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lxcdev_trace
+#include <trace/define_trace.h>
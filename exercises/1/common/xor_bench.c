@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "zfxor.h"
+
+/* GB/s of the old byte loops against the shared zfxor.h routines */
+
+#define BENCH_BYTES (1UL << 30)
+
+typedef void (*xor_fn)(unsigned char *dst, const unsigned char *src, size_t len,
+                       unsigned char key);
+
+/* what the drivers used to do; kernel builds don't vectorize it either */
+__attribute__((optimize("no-tree-vectorize")))
+static void xor_bytes(unsigned char *dst, const unsigned char *src, size_t len,
+                      unsigned char key)
+{
+    size_t i = 0;
+
+    for (i = 0; i < len; ++i)
+    {
+        dst[i] = src[i] ^ key;
+    }
+}
+
+static void xor_dispatch(unsigned char *dst, const unsigned char *src, size_t len,
+                         unsigned char key)
+{
+    zf_xor(dst, src, len, key);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, xor_fn fn, unsigned char *buf, size_t size)
+{
+    unsigned long rounds = BENCH_BYTES / size;
+    unsigned long i = 0;
+    double start = now();
+    double secs = 0;
+
+    for (i = 0; i < rounds; ++i)
+    {
+        fn(buf, buf, size, ZF_XOR_KEY);
+        __asm__ __volatile__("" : : "r"(buf) : "memory");
+    }
+    secs = now() - start;
+    printf("%-8s %8zu bytes %8.2f GB/s\n", name, size, (double)rounds * size / secs / 1e9);
+}
+
+int main()
+{
+    static const size_t sizes[] = { 36, 256, 4096, 64 * 1024, 1024 * 1024 };
+    unsigned char *buf = malloc(sizes[4] + 1);
+    unsigned int s = 0;
+
+    if (buf == NULL)
+    {
+        return 1;
+    }
+    memset(buf, 0xa5, sizes[4] + 1);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        /* +1 keeps the buffer unaligned like most user data */
+        run("byte", xor_bytes, buf + 1, sizes[s]);
+        run("word", zf_xor_words, buf + 1, sizes[s]);
+#ifdef ZF_XOR_SIMD
+        run("sse2", zf_xor_sse2, buf + 1, sizes[s]);
+        if (__builtin_cpu_supports("avx2"))
+        {
+            run("avx2", zf_xor_avx2, buf + 1, sizes[s]);
+        }
+#endif
+        run("zf_xor", xor_dispatch, buf + 1, sizes[s]);
+    }
+
+    free(buf);
+    return 0;
+}
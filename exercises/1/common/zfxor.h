@@ -0,0 +1,100 @@
+#ifndef _ZF_XOR_H_
+#define _ZF_XOR_H_
+
+/*
+ * The 0x55 transform shared by the exercise drivers and their userspace
+ * tools. It works an unsigned long at a time with a byte tail. Userspace
+ * x86_64 builds also get SSE2/AVX2 paths picked at run time. Kernel builds
+ * stay on the word loop: SIMD there needs kernel_fpu_begin(), which costs
+ * more than it saves on buffers of a few pages.
+ *
+ * dst and src may be the same buffer, other overlaps are not supported.
+ */
+
+#define ZF_XOR_KEY 0x55
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ZF_XOR_SIMD 1
+#endif
+#endif
+
+/* key copied into every byte of an unsigned long */
+#define ZF_XOR_WORD(key) ((unsigned long)(unsigned char)(key) * (~0UL / 0xff))
+
+static inline void zf_xor_words(unsigned char *dst, const unsigned char *src, size_t len,
+                                unsigned char key)
+{
+    unsigned long pattern = ZF_XOR_WORD(key);
+    unsigned long word = 0;
+    size_t i = 0;
+
+    /* fixed size memcpy is a plain unaligned load/store */
+    for (; i + sizeof(word) <= len; i += sizeof(word))
+    {
+        memcpy(&word, src + i, sizeof(word));
+        word ^= pattern;
+        memcpy(dst + i, &word, sizeof(word));
+    }
+
+    for (; i < len; ++i)
+    {
+        dst[i] = src[i] ^ key;
+    }
+}
+
+#ifdef ZF_XOR_SIMD
+static inline void zf_xor_sse2(unsigned char *dst, const unsigned char *src, size_t len,
+                               unsigned char key)
+{
+    __m128i pattern = _mm_set1_epi8((char)key);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, pattern));
+    }
+    zf_xor_words(dst + i, src + i, len - i, key);
+}
+
+__attribute__((target("avx2")))
+static inline void zf_xor_avx2(unsigned char *dst, const unsigned char *src, size_t len,
+                               unsigned char key)
+{
+    __m256i pattern = _mm256_set1_epi8((char)key);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(v, pattern));
+    }
+    zf_xor_words(dst + i, src + i, len - i, key);
+}
+#endif
+
+static inline void zf_xor(void *dst, const void *src, size_t len, unsigned char key)
+{
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+
+#ifdef ZF_XOR_SIMD
+    if (len >= 64 && __builtin_cpu_supports("avx2"))
+    {
+        zf_xor_avx2(d, s, len, key);
+        return;
+    }
+    zf_xor_sse2(d, s, len, key);
+#else
+    zf_xor_words(d, s, len, key);
+#endif
+}
+
+#endif